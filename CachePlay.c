@@ -4,235 +4,5026 @@
  * It takes a memory trace as input
  * Simulates hits/miss/eviction behaviour of cache memorty
  * Outputs the total number of hits, misses and evictions
+ * Built with -DCSIM_LIBRARY it is the library of CachePlay.h instead
  *
 */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <math.h>
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(CSIM_NO_SIMD)
+#define CSIM_SIMD 1
+#include <immintrin.h>
+#endif
 
+#include "CachePlay.h"
+#include "cachetrace.h"
+#ifndef CSIM_LIBRARY
 #include "cachelab.h"
+#endif
+
+typedef struct replacement_policy replacement_policy;
+typedef struct prefetcher prefetcher;
 
 /* Struct for cache parameters, include both inputs and outputs */
 typedef struct {
 	int s;  // S = 2^s set index bits
 	int E;  // associativity, E lines per set
 	int b;  // B = 2^b block bits 
+	const replacement_policy *policy;  // replacement policy
+	int write_back;  // 1 write-back, 0 write-through
+	int write_allocate;  // 1 write-allocate, 0 no-write-allocate
+	int index;  // INDEX_ set index function
+	unsigned long long int index_sets;  // sets used by INDEX_PRIME, a prime up to 2^s
+
+	long hit_count; // number of hits
+	long miss_count; // number of misses
+	long eviction_count; // number of evictions 
+	long dirty_eviction_count;  // evictions that wrote the line back
+	unsigned long long int bytes_read;  // bytes filled from the next level
+	unsigned long long int bytes_written;  // bytes written to the next level
+} cache_parameter;
+
+/* Way search routines of a set, picked at startup by the host's vector support */
+typedef struct {
+	const char *name;
+	// return way holding tag or -1, set *empty to first invalid way (or -1) on miss
+	int (*find_way)(const unsigned long long int *tags, const unsigned char *valid, 
+			int E, unsigned long long int tag, int *empty);
+	// return first way with the smallest recency
+	int (*min_way)(const unsigned long long int *recency, int E);
+} way_search;
+
+/* 
+ * Struct for cache, one flat allocation split into per-line arrays,
+ * line i of set k lives at index k * E + i of each array
+ */
+typedef struct {
+	unsigned long long int *tags;  // tag of each line
+	unsigned long long int *recency;  // last access time of each line
+	unsigned int *meta;  // per line policy state, RRPV or use count
+	unsigned char *valid;  // valid bit of each line
+	unsigned char *dirty;  // dirty bit of each line, write-back only
+	unsigned long long int *set_state;  // per set policy state, PLRU bits or random seed
+	unsigned int *last_way;  // per set way of the last hit or fill, checked before searching
+	int E;  // lines per set, copied from the parameters
+	int psel;  // DRRIP policy selector, saturating counter
+	const replacement_policy *policy;  // replacement policy
+	const way_search *ways;  // way search routines for this associativity
+	prefetcher *pf;  // prefetch engine, NULL for none
+	void *mem;  // base of the allocation
+	size_t mem_len;  // length of the allocation
+} cache;
+
+/* 
+ * Replacement policy, called by visit_cache on a hit, on filling a line
+ * after a miss, and for the way to evict when the set is full
+ */
+struct replacement_policy {
+	const char *name;
+	int max_ways;  // largest supported associativity, 0 for any
+	int pow2_ways;  // 1 if the associativity must be a power of two
+	void (*on_hit)(cache *cur_cache, size_t set, int way, unsigned long long int cnt);
+	void (*on_fill)(cache *cur_cache, size_t set, int way, unsigned long long int cnt);
+	int (*victim)(cache *cur_cache, size_t set);
+};
+
+#define RRPV_MAX 3  // 2 bit re-reference prediction values
+#define BRRIP_LONG_ODDS 32  // BRRIP inserts with RRPV_MAX - 1 once in this many fills
+#define DUEL_PERIOD 32  // one SRRIP and one BRRIP leader set per this many sets
+#define PSEL_MAX 1023  // 10 bit DRRIP selector
+
+/* Set index functions */
+enum {
+	INDEX_LOW,  // the s bits above the block offset
+	INDEX_XOR,  // those bits xor the tag folded into s bits
+	INDEX_PRIME,  // block number modulo a prime number of sets
+	INDEX_SKEW  // a different hash per way, skewed associative
+};
+
+#define MAX_LEVELS 4  // deepest cache hierarchy
+#define FIND_EMPTY (-2)  // fill_cache should search the set for a free way
+
+/* Result of a cache access, the same as the CSIM_ results of CachePlay.h */
+enum {
+	ACCESS_HIT,
+	ACCESS_MISS,  // filled a free line, or did not allocate
+	ACCESS_EVICT  // filled over a valid line
+};
+
+/* Inclusion policy of a cache hierarchy */
+enum {
+	INCL_NINE,  // non-inclusive non-exclusive
+	INCL_INCLUSIVE,  // lower levels hold everything above them
+	INCL_EXCLUSIVE  // a block lives in at most one level
+};
+
+/* Struct for one level of a cache hierarchy */
+typedef struct {
+	cache_parameter para;  // geometry, policy and counts
+	cache c;
+	long back_invalidations;  // lines dropped to keep an inclusive hierarchy inclusive
+} cache_level;
+
+#define CACHE_ALIGN 64  // host cache line size, arrays start on one
+#define SIMD_MIN_WAYS 8  // below this associativity the scalar search wins
+
+/* Struct for one memory access parsed from the trace */
+typedef struct {
+	char op;  // operation, I, L, S or M
+	int size;  // access size in bytes
+	unsigned long long int addr;  // addr, 64 bit hex
+	unsigned long long int ts;  // optional ",ts" timestamp of text records, else 0
+} trace_record;
+
+/* Struct for a run of records to one block, collapsed by -r */
+typedef struct {
+	char op;
+	int size;
+	unsigned long long int addr;  // address of the first record
+	unsigned long long int cnt;  // access time of the first record
+	unsigned long long int n;  // records in the run, 0 for none
+} access_run;
+
+#define SHARD_CHUNK 4096  // accesses handed to a shard at a time
+#define SHARD_QUEUE 8  // chunks per shard, bounds the reader's lead
+
+/* Struct for an access routed to a shard */
+typedef struct {
+	unsigned long long int addr;  // addr, 64 bit hex
+	unsigned long long int cnt;  // access time in the serial run
+	int size;  // access size in bytes
+	char op;  // L, S or M
+} shard_access;
+
+/* Struct for a chunk of accesses */
+typedef struct {
+	shard_access acc[SHARD_CHUNK];
+	int n;  // accesses filled
+} shard_chunk;
+
+/* 
+ * Struct for one simulation thread of -j, owning a range of sets. The
+ * reader fills ring[tail] while the thread drains the count chunks
+ * from ring[head] on.
+ */
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	shard_chunk *ring;  // SHARD_QUEUE chunks
+	int head;  // oldest published chunk
+	int tail;  // chunk being filled by the reader
+	int count;  // published chunks not yet simulated
+	int done;  // reader hit the end of the trace
+	cache *c;  // shared cache, only this shard's sets are touched
+	cache_parameter para;  // this shard's counts
+} sim_shard;
+
+#define SD_BUCKETS 34  // log2 stack distance buckets, bucket 0 is distance 0
+#define SD_MAX_WAYS 64  // widest associativity of the per set curve
+#define SD_HASH_RANGE (1ULL << 47)  // block_hash values lie below this
+#define SD_UNSAMPLED (-2)  // stack_distance_access skipped a block outside the sample
+
+/* Struct for a treap node, one per distinct block, keyed by last access time */
+typedef struct {
+	unsigned long long int key;  // last access time
+	unsigned int prio;  // heap priority
+	unsigned int size;  // nodes in this subtree
+	unsigned int left, right;  // children, 0 for none
+} sd_node;
+
+/* Struct for a block table entry, block number to its treap nodes */
+typedef struct {
+	unsigned long long int block;
+	unsigned int fa_node;  // node in the fully associative tree, 0 if slot empty
+	unsigned int set_node;  // node in the tree of the block's set
+} sd_block;
+
+/* 
+ * Struct for the stack distance engine. Each tree is an order statistic
+ * tree of blocks by last access time, so the stack distance of a block
+ * is the number of keys above its own.
+ */
+typedef struct {
+	int s, b;  // set bits of the per set curve (-1 for none), block bits
+	sd_node *nodes;  // node pool, node 0 unused
+	unsigned int n_nodes, cap_nodes;
+	sd_block *blocks;  // open addressing table, power of two size
+	size_t cap_blocks;
+	unsigned long long int n_blocks;  // distinct blocks
+	unsigned int fa_root;  // fully associative tree
+	unsigned int *set_roots;  // one tree per set, NULL without the per set curve
+	unsigned long long int sample_max;  // blocks held before the sample rate halves, 0 to keep all
+	int sample_shift;  // blocks are sampled at rate 2^-sample_shift
+	unsigned long long int seed;  // priority generator
+	unsigned long long int last_block;  // block of the newest access, the top of every stack it is in
+	unsigned long long int accesses;
+	unsigned long long int cold;  // first touches
+	unsigned long long int fa_hist[SD_BUCKETS];  // fully associative distances, log2 buckets
+	unsigned long long int set_hist[SD_MAX_WAYS + 1];  // per set distances, last is overflow
+} sd_engine;
+
+#define BLOCK_MAP_EMPTY (~0ULL)  // key of an empty block map slot
+#define PROF_BUCKETS 64  // log2 reuse distance buckets, bucket 0 is distance 0
+#define PROF_TOP_TAGS 4  // conflicting tags tracked per set
+#define PROF_SAMPLE_MAX 1024  // blocks the -P reuse stack holds, footprints up to this are exact
+
+/* Struct for a block map slot, key and value share a host cache line */
+typedef struct {
+	unsigned long long int key;  // block number, BLOCK_MAP_EMPTY for a free slot
+	unsigned long long int val;
+} block_slot;
+
+/* Struct for a hash map from block number to a 64 bit value, open addressing */
+typedef struct {
+	block_slot *slots;
+	size_t cap;  // slots, power of two
+	size_t n;  // keys held
+} block_map;
+
+/* Struct for the profile of one set */
+typedef struct {
+	unsigned long long int accesses;
+	unsigned long long int misses;
+	unsigned long long int evictions;
+	unsigned long long int hot_tags[PROF_TOP_TAGS];  // most evicted tags
+	unsigned long long int hot_counts[PROF_TOP_TAGS];  // their eviction counts, 0 if unused
+} set_profile;
+
+/* Struct for the -P profile of a run */
+typedef struct {
+	unsigned long long int reuse_hist[PROF_BUCKETS];  // reuse distances, log2 buckets, estimated
+	unsigned long long int cold;  // first touches, no reuse distance, estimated
+	set_profile *set_stats;  // one per set
+	sd_engine stack;  // fully associative LRU stack of a bounded sample of blocks
+} cache_profile;
+
+#define SHADOW_NIL (~0u)  // end of the shadow recency list
+
+/* Miss classes of the 3C model */
+enum {
+	MISS_NONE,  // not a miss
+	MISS_COMPULSORY,  // first touch of the block
+	MISS_CAPACITY,  // a fully associative cache of the same size misses too
+	MISS_CONFLICT  // only the set mapping made it miss
+};
+
+/* 
+ * Struct for the -3 miss classifier: the blocks ever seen, and a fully
+ * associative LRU shadow cache of the real cache's size, kept as a
+ * block map to line plus a doubly linked recency list over the lines
+ */
+typedef struct {
+	block_map seen;  // every block touched so far
+	block_map where;  // block number to its shadow line
+	unsigned long long int *blocks;  // block of each shadow line
+	unsigned int *prev, *next;  // recency list, head is most recent
+	unsigned int head, tail;
+	unsigned int used, capacity;  // shadow lines in use and available
+	long compulsory;
+	long capacity_misses;
+	long conflict;
+} miss_classifier;
+
+/* Prefetch engines */
+enum {
+	PF_NEXT_LINE,  // the blocks after a miss
+	PF_STRIDE,  // constant strides of up to a region, IP-less reference prediction table
+	PF_STREAM  // ascending or descending streams confirmed by two nearby misses
+};
+
+#define RPT_ENTRIES 256  // stride table entries
+#define RPT_REGION_BITS 14  // the stride table tracks one entry per 16KB region, the longest stride
+#define RPT_STEADY 2  // confirmations before a stride is prefetched
+#define STREAM_TRACKERS 8  // streams followed at once
+#define PREFETCH_LATENCY 16  // default records until a prefetch arrives
+
+/* Struct for a stride table entry */
+typedef struct {
+	unsigned long long int region;  // region number, ~0 when unused
+	unsigned long long int last;  // last block of the entry's stream, in the region
+	long long int stride;  // last block delta
+	int confidence;  // times the stride repeated, saturates at RPT_STEADY
+} rpt_entry;
+
+/* Struct for a followed stream */
+typedef struct {
+	unsigned long long int last;  // last block demanded from the stream
+	unsigned long long int front;  // next block to prefetch
+	int dir;  // 1 ascending, -1 descending, 0 not confirmed yet
+	unsigned long long int used;  // time of the last match, for replacement
+} stream_tracker;
+
+/* 
+ * Prefetch engine attached to a cache. Prefetches fill the cache like
+ * demand misses but are counted apart, each prefetched line remembers
+ * when it was issued until its first demand access.
+ */
+struct prefetcher {
+	int engine;  // PF_ engine
+	int degree;  // blocks prefetched per trigger
+	int distance;  // blocks between the trigger and the first prefetch
+	int latency;  // records a prefetch takes to arrive
+	unsigned long long int *issued_at;  // per line issue time, 0 once demanded
+	rpt_entry rpt[RPT_ENTRIES];
+	stream_tracker streams[STREAM_TRACKERS];
+	block_map victims;  // blocks evicted by prefetches, not demanded since
+	size_t demand_line;  // line of the demand access being observed, prefetches never evict it
+	long issued;  // prefetches that filled a line
+	long useful;  // prefetched lines demanded after they arrived
+	long late;  // prefetched lines demanded before they arrived
+	long polluting;  // demand misses on blocks a prefetch evicted
+	long useless;  // prefetched lines evicted without a demand access
+	long evictions;  // valid lines evicted by prefetches
+};
+
+/* Struct for the optional instrumentation of a single level run, NULL when off */
+typedef struct {
+	cache_profile *prof;  // -P
+	miss_classifier *classes;  // -3
+} sim_instruments;
+
+/* 
+ * Struct for -S set sampling: only a hashed subset of sets is simulated,
+ * with counts kept per set so totals can be extrapolated with an error.
+ * Every record is still read and decoded, which then dominates, so a
+ * sampled run is only about 1.5x faster than a full one, at any ratio.
+ */
+typedef struct {
+	int ratio;  // about one set in ratio is simulated
+	unsigned char *in;  // 1 for each sampled set
+	long *hits, *misses, *evictions;  // counts of each sampled set
+	size_t sets;  // sets in the cache
+	size_t sampled;  // sets in the sample
+} set_sample;
+
+#define TIMING_MSHRS 8  // default outstanding misses of -M
+#define TIMING_WINDOW 64  // default records in flight of -M
+
+/* 
+ * Struct for the -M timing model. Records issue one per cycle and retire
+ * in order, at most window of them in flight, so independent misses
+ * close together overlap. Misses below L1 hold one of the MSHRs until
+ * their block arrives, later accesses to that block wait for it too.
+ */
+typedef struct {
+	int n_levels;  // levels with a hit latency
+	int hit_latency[MAX_LEVELS];  // cycles to hit at each level, added level by level
+	int memory_latency;  // cycles from memory after missing every level
+	int mshrs;  // misses outstanding at once
+	int window;  // records in flight at once
+	int b;  // block bits, misses to one block share an MSHR
+	unsigned long long int *mshr_block;  // block each MSHR fetches
+	unsigned long long int *mshr_done;  // cycle it arrives
+	unsigned long long int *retire;  // retire cycle of the last window records, a ring
+	unsigned long long int now;  // issue cycle of the next record
+	unsigned long long int last_retire;  // retire cycle of the last record
+	unsigned long long int start;  // cycle counting started, moved by a warmup
+	unsigned long long int records;  // records timed
+	unsigned long long int latency_sum;  // cycles from issue to data of every access
+	unsigned long long int mshr_stalls;  // issue cycles lost waiting for an MSHR
+	unsigned long long int window_stalls;  // issue cycles lost waiting for the window
+} timing_model;
+
+#define MAX_TLB_LEVELS 3  // deepest TLB hierarchy
+#define MAX_PAGE_RANGES 16  // ranges of the -g page map
+#define WALK_BASE 0xf000000000000000ULL  // page tables live above every traced address
+
+/* Page sizes of the TLB model, their x86-64 walks load 4, 3 and 2 entries */
+enum {
+	PAGE_4K,
+	PAGE_2M,
+	PAGE_1G,
+	PAGE_SIZES
+};
+
+/* Struct for one range of the -g page map, mapped with pages of one size */
+typedef struct {
+	unsigned long long int lo, hi;  // addresses lo up to but not including hi
+	int size;  // PAGE_ size
+} page_range;
+
+/* 
+ * Struct for the -K TLB model. Each level is a cache of page numbers,
+ * one line per page with no offset bits and the page size in the top
+ * tag bits. A translation that misses every level walks the page table,
+ * each step an 8 byte load through the data caches.
+ */
+typedef struct {
+	cache_level levels[MAX_TLB_LEVELS];
+	int latency[MAX_TLB_LEVELS];  // cycles of a lookup reaching each level, for -M
+	int n_levels;
+	int default_size;  // PAGE_ size outside every range
+	page_range ranges[MAX_PAGE_RANGES];
+	int n_ranges;
+	long translations[PAGE_SIZES];  // counts per page size from here
+	long misses[PAGE_SIZES];  // missed the first level
+	long walks[PAGE_SIZES];  // missed every level
+	long walk_refs[PAGE_SIZES];  // page table loads
+	long walk_memory_refs[PAGE_SIZES];  // of those, served by memory
+	unsigned long long int cycles[PAGE_SIZES];  // lookup and walk cycles, with -M
+} tlb_model;
+
+#define CHECKPOINT_MAGIC "CSIMCKP2"
+#define CHECKPOINT_EVERY 10000000  // default records between checkpoints
+
+/* Struct for one cache level in a checkpoint */
+typedef struct {
+	int s, E, b;
+	char policy[16];  // policy name
+	int write_back, write_allocate;
+	int psel;  // DRRIP selector
+	int index;  // set index function
+	long hit_count, miss_count, eviction_count, dirty_eviction_count;
+	unsigned long long int bytes_read, bytes_written;
+	long back_invalidations;
+	unsigned long long int mem_len;  // length of the cache's flat arrays
+	unsigned long long int mem_offset;  // their page aligned place in the file
+} checkpoint_level;
+
+/* 
+ * Struct for the header of a checkpoint file. The flat arrays of each
+ * level follow it, page aligned, so a resume maps them straight back.
+ */
+typedef struct {
+	char magic[8];
+	int n_levels;
+	int inclusion;
+	unsigned long long int cnt;  // access time of the next record
+	unsigned long long int trace_len;  // length of the trace, to catch another trace
+	unsigned long long int trace_offset;  // bytes of the trace consumed
+	unsigned long long int last_addr;  // binary trace delta base
+	checkpoint_level level[MAX_LEVELS];
+} checkpoint_header;
+
+/* Library handle of CachePlay.h, one cache and its access time */
+struct csim {
+	cache_parameter para;  // geometry, policy and counts
+	cache c;
+	prefetcher pf;  // used if c.pf is set
+	int span_bits;  // see next_piece
+	unsigned long long int cnt;  // access time
+};
+
+/* Struct for one configuration of a -G sweep and its result */
+typedef struct {
+	csim_config config;
+	csim_counts counts;
+	int ok;  // 0 if the configuration cannot be built
+	double seconds;  // fastest run of a --bench point
+} sweep_point;
+
+/* Struct for the points queued at one sweep worker, thieves take from the bottom */
+typedef struct {
+	pthread_mutex_t lock;
+	int *items;  // point indexes, most expensive at the top
+	int top, bottom;  // items[top, bottom) are left
+} sweep_deque;
+
+/* Struct for a sweep, every point runs over the same decoded trace */
+typedef struct {
+	sweep_point *points;
+	int n_points;
+	const csim_record *records;
+	size_t n_records;
+	sweep_deque *deques;  // one per worker
+	int n_workers;
+} sweep_pool;
+
+/* Struct for a sweep worker thread */
+typedef struct {
+	pthread_t thread;
+	sweep_pool *pool;
+	int id;
+} sweep_worker;
+
+#define SWEEP_MAX_POINTS 65536  // largest grid of a sweep
+#define SWEEP_MAX_VALUES 64  // values per grid dimension
+#define BENCH_REPEAT 3  // timed runs of each --bench point, the fastest counts
+#define GEN_BASE 0x10000000ULL  // first address of a generated trace
+#define GEN_ELEMENT 8  // bytes of each generated access
+#define GEN_NODE 64  // bytes of each pointer chase node
+
+#define SAMPLE_Z 1.96  // normal quantile of the reported 95% intervals
+
+/* Struct for -i/-T interval reporting of a running simulation */
+typedef struct {
+	unsigned long long int every;  // records per interval, 0 for none
+	double seconds;  // wall seconds per interval, 0 for none
+	double next_time;  // wall time of the next timed report
+	unsigned long long int records;  // records at the last report
+	long hits, misses, evictions;  // totals at the last report
+	int n;  // reports so far
+} interval_stats;
+
+#define INTERVAL_CLOCK_EVERY 4096  // records between clock reads of -T
+
+/* Struct for trace reader, parses the mmaped trace in place */
+typedef struct {
+	const char *cur;  // next byte to parse
+	const char *end;  // one past the last byte
+	void *map;  // base of the mapping
+	size_t map_len;  // length of the mapping
+	int binary;  // 1 if the trace is in the binary format
+	unsigned long long int last_addr;  // previous addr, for binary deltas
+	int fd;  // stream being read into buf, -1 for a mapped file
+	char *buf;  // stream buffer, cur and end point into it
+	int eof;  // stream has no more bytes
+	cachetrace_ring *ring;  // shared ring being drained, NULL otherwise
+	unsigned long long int ring_head;  // records the producer had published at the last look
+	unsigned long long int ring_tail;  // records consumed, published every batch
+	size_t ring_len;  // length of the ring's mapping
+} trace_reader;
+
+#define STREAM_BUF (1 << 20)  // stream buffer size
+#define BINARY_RECORD_MAX 21  // header byte and two varints
+
+/* 
+ * Binary trace format: the 8 byte magic below, then one record per
+ * access. Each record is a header byte, holding the op in bits 0-1
+ * (I, L, S, M) and the size in bits 2-7, followed by the zigzag varint
+ * of the address delta from the previous record. Size 63 marks a size
+ * too large for the header, it then follows as a varint after the
+ * header byte.
+ */
+#define TRACE_MAGIC "\x7f" "CSTRACE"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_SIZE_ESCAPE 63
+
+#define MAX_CORES 64  // cores of a coherent run, one trace each
+#define COHERENCE_TOP_LINES 16  // busiest lines reported by a coherent run
+
+/* Coherence state of a line in a core's private cache */
+enum {
+	LINE_I,  // invalid, only seen while snooping a cache without the block
+	LINE_S,  // shared, clean
+	LINE_E,  // exclusive, clean
+	LINE_O,  // owned, dirty and shared, MOESI only
+	LINE_M  // modified, dirty and exclusive
+};
+
+/* Order in which the records of the per core traces are merged */
+enum {
+	ORDER_ROUND_ROBIN,  // one record of each core in turn
+	ORDER_TIMESTAMP  // smallest timestamp first
+};
+
+/* Struct for one core of a coherent run, its private cache and its trace */
+typedef struct {
+	cache_parameter para;  // geometry, policy and counts
+	cache c;
+	unsigned char *state;  // coherence state of each line, valid lines only
+	trace_reader reader;
+	trace_record rec;  // next record, pending until the core's turn
+	unsigned long long int records;  // records read so far
+	int done;  // trace used up
+} core_cache;
+
+/* Struct for the coherence traffic of one block */
+typedef struct {
+	unsigned long long int block;  // block number
+	long invalidations;  // copies dropped by other cores' writes
+	long upgrades;  // writes to a shared or owned copy
+	long transfers;  // misses served by another core's cache
+	unsigned long long int cores;  // mask of cores that touched it
+} line_traffic;
+
+/* 
+ * Struct for a coherent run: private caches of the same geometry kept
+ * coherent by a MESI or MOESI snooping bus, with the traffic of each
+ * block so false sharing shows up as lines many cores fight over
+ */
+typedef struct {
+	core_cache *cores;
+	int n;  // number of cores
+	int moesi;  // 1 for MOESI, 0 for MESI
+	block_map lines;  // block number to its index in traffic
+	line_traffic *traffic;
+	size_t n_lines, cap_lines;
+	long invalidations, upgrades, transfers;
+	long flushes;  // MESI writes back a modified line another core reads
+} coherence_sim;
+
+int alloc_cache(cache *c, cache_parameter para);
+cache init_cache(cache_parameter input_para);
+cache map_cache(cache_parameter para, void *mem, size_t mem_len);
+int get_set(unsigned long long int addr, cache_parameter para);
+unsigned long long int get_tag(unsigned long long int addr, cache_parameter para);
+void free_cache(cache cache_cur, cache_parameter para);
+cache_parameter visit_cache(cache_parameter para, cache *cur_cache, 
+		unsigned long long int addr, unsigned long long int cnt, int verbo);
+cache_parameter store_cache(cache_parameter para, cache *cur_cache, 
+		unsigned long long int addr, int size, unsigned long long int cnt, int verbo);
+cache_parameter visit_op(cache_parameter para, cache *cur_cache, char op, 
+		unsigned long long int addr, int size, unsigned long long int cnt, int verbo);
+cache_parameter visit_run(cache_parameter para, cache *cur_cache, access_run *run);
+void reset_counts(cache_parameter *para);
+int visit_hierarchy(cache_level *levels, int n, int inclusion, 
+		unsigned long long int addr, unsigned long long int cnt, int verbo);
+int parse_level(const char *spec, cache_parameter *para);
+int set_index(const char *name, cache_parameter *para);
+unsigned long long int block_of(unsigned long long int tag, size_t set, cache_parameter para);
+int check_policy(cache_parameter para, char *why, size_t len);
+cache_parameter simulate_sharded(cache_parameter para, cache *cur_cache, 
+		trace_reader *reader, int n, int span_bits);
+void init_stack_distance(sd_engine *sd, int s, int b, unsigned long long int sample_max);
+long long int stack_distance_access(sd_engine *sd, unsigned long long int addr);
+void print_stack_distance(sd_engine *sd);
+void free_stack_distance(sd_engine *sd);
+void init_block_map(block_map *map);
+unsigned long long int *block_map_get(block_map *map, unsigned long long int block, int *fresh);
+void free_block_map(block_map *map);
+void init_profile(cache_profile *prof, int s, int b);
+void block_map_remove(block_map *map, unsigned long long int block);
+cache_parameter visit_instrumented(cache_parameter para, cache *cur_cache, sim_instruments *ins, 
+		unsigned long long int addr, int size, unsigned long long int cnt, int is_store, int verbo);
+int write_profile(cache_profile *prof, cache_parameter para, const char *path);
+void free_profile(cache_profile *prof);
+void init_classifier(miss_classifier *mc, cache_parameter para);
+int classify_access(miss_classifier *mc, unsigned long long int block, int hit);
+void free_classifier(miss_classifier *mc);
+int init_prefetcher(prefetcher *pf, const char *spec, cache_parameter para);
+void free_prefetcher(prefetcher *pf);
+void init_sampling(set_sample *ss, cache_parameter para, int ratio);
+cache_parameter visit_sampled(cache_parameter para, cache *cur_cache, set_sample *ss, char op, 
+		unsigned long long int addr, int size, unsigned long long int cnt, int verbo);
+void reset_sampling(set_sample *ss);
+void print_sampling(set_sample *ss, cache_parameter *para);
+void free_sampling(set_sample *ss);
+void init_intervals(interval_stats *is, unsigned long long int every, double seconds);
+void interval_tick(interval_stats *is, unsigned long long int records, 
+		long hits, long misses, long evictions, int force);
+void report_interval(interval_stats *is, unsigned long long int records, 
+		cache_level *levels, int n_levels, cache_parameter para, int force);
+int LRU_earliest(cache *cur_cache, size_t set);
+const way_search *pick_way_search(int E);
+const replacement_policy *find_policy(const char *name);
+void init_digit_table(void);
+int open_trace(trace_reader *reader, const char *path);
+int next_record(trace_reader *reader, trace_record *rec);
+int next_piece(trace_record *rest, int b, trace_record *piece);
+int next_text_record(trace_reader *reader, trace_record *rec);
+int next_binary_record(trace_reader *reader, trace_record *rec);
+int open_ring(trace_reader *reader, const char *name);
+int next_ring_record(trace_reader *reader, trace_record *rec);
+void close_trace(trace_reader *reader);
+long convert_trace(trace_reader *reader, const char *out_path);
+int init_coherence(coherence_sim *sim, cache_parameter para, char **paths, int n, int moesi);
+int coherent_access(coherence_sim *sim, int id, unsigned long long int addr, 
+		unsigned long long int cnt, int is_store);
+void simulate_coherent(coherence_sim *sim, int order, int span_bits, int verbo);
+void print_coherence(coherence_sim *sim);
+void free_coherence(coherence_sim *sim);
+int init_timing(timing_model *tm, const char *spec, int b);
+void time_access(timing_model *tm, unsigned long long int addr, int served, int is_store, 
+		unsigned long long int translation);
+void reset_timing(timing_model *tm);
+void print_timing(timing_model *tm);
+void free_timing(timing_model *tm);
+void init_tlb(tlb_model *tlb);
+int add_tlb_level(tlb_model *tlb, const char *spec);
+int set_page_map(tlb_model *tlb, const char *spec);
+void alloc_tlb(tlb_model *tlb);
+unsigned long long int translate(tlb_model *tlb, unsigned long long int addr, 
+		unsigned long long int cnt, cache_parameter *para, cache *c, 
+		cache_level *levels, int n, int inclusion, timing_model *tm, int verbo);
+void reset_tlb(tlb_model *tlb);
+void print_tlb(tlb_model *tlb, int timed);
+void free_tlb(tlb_model *tlb);
+int write_checkpoint(const char *path, cache_level *levels, int n, int inclusion, 
+		trace_reader *reader, unsigned long long int cnt);
+int load_checkpoint(const char *path, cache_level *levels, int n, int inclusion, 
+		trace_reader *reader, unsigned long long int *cnt);
+csim_record *decode_trace(trace_reader *reader, size_t *n);
+int parse_sweep(const char *grid, csim_config base, sweep_point **points);
+void run_sweep(sweep_pool *pool, int n_workers);
+void print_sweep(sweep_pool *pool);
+csim_record *generate_trace(const char *spec, size_t *n);
+void run_bench(sweep_pool *pool);
+void print_bench(sweep_pool *pool, const char *name, int header);
+
+/* Op letter of each binary op code */
+static const char trace_ops[4] = {'I', 'L', 'S', 'M'};
+
+/* Digit value of each byte, 0xff for bytes that are not hex digits */
+static unsigned char digit_table[256];
+
+/* Round len up to a multiple of CACHE_ALIGN */
+static inline size_t align_up(size_t len) {
+	return (len + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+}
+
+/* Hash of a block number */
+static inline size_t block_hash(unsigned long long int block) {
+	return (size_t)((block * 0x9e3779b97f4a7c15ULL) >> 17);
+}
+
+/* 
+ * Lay the arrays of a cache of geometry para out from base, and return
+ * the length of the layout. A NULL base only measures it.
+ */
+static size_t lay_out_cache(cache *c, cache_parameter para, char *base) {
+	size_t sets = (size_t)1 << para.s;
+	size_t lines = sets * para.E;
+	// each array is padded so vector loads may run past the last set
+	size_t tags_len = align_up(sizeof(unsigned long long int) * lines) + CACHE_ALIGN;
+	size_t recency_len = align_up(sizeof(unsigned long long int) * lines) + CACHE_ALIGN;
+	size_t meta_len = align_up(sizeof(unsigned int) * lines) + CACHE_ALIGN;
+	size_t valid_len = align_up(sizeof(unsigned char) * lines) + CACHE_ALIGN;
+	size_t dirty_len = align_up(sizeof(unsigned char) * lines);
+	size_t set_state_len = align_up(sizeof(unsigned long long int) * sets);
+	size_t last_way_len = align_up(sizeof(unsigned int) * sets);
+	if(base != NULL) {
+		c->tags = (unsigned long long int*)base;
+		c->recency = (unsigned long long int*)(base + tags_len);
+		c->meta = (unsigned int*)(base + tags_len + recency_len);
+		c->valid = (unsigned char*)(base + tags_len + recency_len + meta_len);
+		c->dirty = (unsigned char*)(base + tags_len + recency_len + meta_len + valid_len);
+		c->set_state = (unsigned long long int*)(base + tags_len + recency_len 
+				+ meta_len + valid_len + dirty_len);
+		c->last_way = (unsigned int*)((char*)c->set_state + set_state_len);
+	}
+	return tags_len + recency_len + meta_len + valid_len + dirty_len + set_state_len + last_way_len;
+}
+
+/* 
+ * Build a cache of geometry para over mem, a mapping of mem_len bytes
+ * holding its arrays, either fresh or loaded from a checkpoint
+ */
+cache map_cache(cache_parameter para, void *mem, size_t mem_len) {
+	cache new_cache;
+	new_cache.mem = mem;
+	new_cache.mem_len = mem_len;
+	lay_out_cache(&new_cache, para, (char*)mem);
+	new_cache.E = para.E;
+	new_cache.psel = PSEL_MAX / 2;
+	new_cache.policy = para.policy;
+	new_cache.ways = pick_way_search(para.E);
+	new_cache.pf = NULL;
+	return new_cache;
+}
+
+/* 
+ * Allocate a cache of geometry para into *c. The arrays come from one
+ * anonymous mapping, which is page aligned and zero filled lazily by the
+ * kernel, so even large caches start without touching their memory.
+ * Return 0 on success, -1 if the mapping fails.
+ */
+int alloc_cache(cache *c, cache_parameter para) {
+	size_t mem_len = lay_out_cache(NULL, para, NULL);
+	void *mem = mmap(NULL, mem_len, PROT_READ | PROT_WRITE, 
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED) {
+		return -1;
+	}
+	*c = map_cache(para, mem, mem_len);
+	return 0;
+}
+
+/* Function that initilize cache, the simulator exits if it cannot be allocated */
+cache init_cache(cache_parameter input_para) {
+	cache new_cache;
+	if(alloc_cache(&new_cache, input_para) != 0) {
+		printf("cache cannot be allocated.\n");
+		exit(1);
+	}
+	return new_cache;
+}
+
+/* Tag folded into s bits by xor of its s bit pieces */
+static inline unsigned long long int fold_tag(unsigned long long int tag, int s) {
+	unsigned long long int folded = 0;
+	if(s == 0) {
+		return 0;
+	}
+	for(; tag != 0; tag >>= s) {
+		folded ^= tag;
+	}
+	return folded;
+}
+
+/* Set of block in way of a skewed cache, one multiplicative hash per way */
+static inline size_t skew_set(unsigned long long int block, int way, int s) {
+	if(s == 0) {
+		return 0;
+	}
+	return (size_t)(((block + way * 0x9e3779b97f4a7c15ULL) * 0xbf58476d1ce4e5b9ULL) >> (64 - s));
+}
+
+/* Get set number from address, skewed caches use skew_set instead */
+int get_set(unsigned long long int addr, cache_parameter para) {
+	unsigned int mask = (1 << para.s) - 1;
+	unsigned long long int block = addr >> para.b;
+	if(para.index == INDEX_LOW || para.index == INDEX_SKEW) {
+		return block & mask;
+	}
+	if(para.index == INDEX_XOR) {
+		return (block ^ fold_tag(block >> para.s, para.s)) & mask;
+	}
+	return (int)(block % para.index_sets);
+}
+
+/* 
+ * Get tag from address. With the xor hash the low bits still follow
+ * from the set and the tag, skewed caches keep the whole block number.
+ */
+unsigned long long int get_tag(unsigned long long int addr, cache_parameter para) { 
+	if(para.index == INDEX_PRIME) {
+		return (addr >> para.b) / para.index_sets;
+	}
+	if(para.index == INDEX_SKEW) {
+		return addr >> para.b;
+	}
+	return addr >> (para.s + para.b);
+}
+
+/* Address of the block with tag in set, the inverse of get_set and get_tag */
+unsigned long long int block_of(unsigned long long int tag, size_t set, cache_parameter para) {
+	unsigned long long int mask = (1ULL << para.s) - 1;
+	if(para.index == INDEX_XOR) {
+		return ((tag << para.s) | ((set ^ fold_tag(tag, para.s)) & mask)) << para.b;
+	}
+	if(para.index == INDEX_PRIME) {
+		return (tag * para.index_sets + set) << para.b;
+	}
+	if(para.index == INDEX_SKEW) {
+		return tag << para.b;
+	}
+	return (tag << (para.s + para.b)) | ((unsigned long long int)set << para.b);
+}
+
+/* Free the cache */
+void free_cache(cache cache_cur, cache_parameter para) {
+	(void)para;
+	if(cache_cur.mem != NULL) {
+		munmap(cache_cur.mem, cache_cur.mem_len);
+	}
+}
+
+/* 
+ * Look addr up in the cache, count the hit or miss. Return the way on a
+ * hit, or -1 on a miss with *empty set to the first free way (or -1).
+ */
+static inline int probe_cache(cache_parameter *para, cache *cur_cache, 
+		unsigned long long int addr, unsigned long long int cnt, int *empty) {
+	size_t set = get_set(addr, *para);
+	size_t base = set * para->E;
+	unsigned long long int tag = get_tag(addr, *para);
+	int way = cur_cache->last_way[set];
+	// repeated accesses to a block, like M and sequential words, skip the search
+	if(!cur_cache->valid[base + way] || cur_cache->tags[base + way] != tag) {
+		way = cur_cache->ways->find_way(cur_cache->tags + base, cur_cache->valid + base, 
+				para->E, tag, empty);
+	}
+	if(way >= 0) {
+		para->hit_count++;
+		cur_cache->policy->on_hit(cur_cache, set, way, cnt);
+		cur_cache->last_way[set] = way;
+		return way;
+	}
+	para->miss_count++;
+	return -1;
+}
+
+/* 
+ * Place the block of addr into way empty of its set, as found by the
+ * probe, -1 to let the policy pick a victim, or FIND_EMPTY to look for
+ * a free way first. Return 1 and the address of the evicted block in
+ * *evicted if a valid line had to go, a dirty one is written back. The
+ * filled way goes to *way unless it is NULL.
+ */
+static inline int fill_cache(cache_parameter *para, cache *cur_cache, 
+		unsigned long long int addr, unsigned long long int cnt, int empty, 
+		unsigned long long int *evicted, int *way) {
+	size_t set = get_set(addr, *para);
+	size_t base = set * para->E;
+	unsigned long long int tag_num = get_tag(addr, *para);
+	if(empty == FIND_EMPTY) {
+		cur_cache->ways->find_way(cur_cache->tags + base, cur_cache->valid + base, 
+				para->E, tag_num, &empty);
+	}
+	para->bytes_read += 1ULL << para->b;
+	// the policy picks a line when the set is full, it may have been invalidated since the probe
+	int evict_idx = empty >= 0 ? empty : cur_cache->policy->victim(cur_cache, set);
+	int was_valid = cur_cache->valid[base + evict_idx];
+	if(was_valid) {
+		para->eviction_count++;
+		*evicted = block_of(cur_cache->tags[base + evict_idx], set, *para);
+		if(cur_cache->dirty[base + evict_idx]) {
+			para->dirty_eviction_count++;
+			para->bytes_written += 1ULL << para->b;
+		}
+	}
+	cur_cache->valid[base + evict_idx] = 1;
+	cur_cache->dirty[base + evict_idx] = 0;
+	cur_cache->tags[base + evict_idx] = tag_num;
+	cur_cache->policy->on_fill(cur_cache, set, evict_idx, cnt);
+	cur_cache->last_way[set] = evict_idx;
+	if(way != NULL) {
+		*way = evict_idx;
+	}
+	return was_valid;
+}
+
+/* Way holding the block of addr, or -1, without counting an access */
+static inline int find_block(cache_parameter para, cache *cur_cache, 
+		unsigned long long int addr) {
+	size_t base = (size_t)get_set(addr, para) * para.E;
+	int empty;
+	return cur_cache->ways->find_way(cur_cache->tags + base, cur_cache->valid + base, 
+			para.E, get_tag(addr, para), &empty);
+}
+
+/* Drop the block of addr from the cache, return 1 if it was there */
+static inline int invalidate_block(cache_parameter para, cache *cur_cache, 
+		unsigned long long int addr) {
+	size_t base = (size_t)get_set(addr, para) * para.E;
+	int way = find_block(para, cur_cache, addr);
+	if(way < 0) {
+		return 0;
+	}
+	cur_cache->valid[base + way] = 0;
+	cur_cache->dirty[base + way] = 0;
+	return 1;
+}
+
+/* 
+ * Prefetch block into the cache unless it is there already. Evictions
+ * it causes are counted by the prefetcher, not as demand evictions.
+ */
+static void prefetch_block(cache_parameter *para, cache *cur_cache, 
+		unsigned long long int block, unsigned long long int cnt) {
+	prefetcher *pf = cur_cache->pf;
+	unsigned long long int addr = block << para->b;
+	unsigned long long int evicted;
+	int way, slot;
+	size_t set = get_set(addr, *para);
+	size_t base = set * para->E;
+	if(cur_cache->ways->find_way(cur_cache->tags + base, cur_cache->valid + base, 
+			para->E, get_tag(addr, *para), &slot) >= 0) {
+		return;
+	}
+	if(slot < 0) {
+		slot = cur_cache->policy->victim(cur_cache, set);
+		// dropped rather than displace the block its trigger just used
+		if(base + slot == pf->demand_line) {
+			return;
+		}
+	}
+	long demand_evictions = para->eviction_count;
+	int evict = fill_cache(para, cur_cache, addr, cnt, slot, &evicted, &way);
+	para->eviction_count = demand_evictions;
+	size_t line = (size_t)get_set(addr, *para) * para->E + way;
+	if(evict) {
+		pf->evictions++;
+		if(pf->issued_at[line] != 0) {
+			pf->useless++;
+		}else {
+			int fresh;
+			block_map_get(&pf->victims, evicted >> para->b, &fresh);
+		}
+	}
+	block_map_remove(&pf->victims, block);
+	pf->issued_at[line] = cnt;
+	pf->issued++;
+}
+
+/* Issue degree prefetches stride blocks apart, starting distance strides after block */
+static void prefetch_run(cache_parameter *para, cache *cur_cache, unsigned long long int block, 
+		long long int stride, unsigned long long int cnt) {
+	prefetcher *pf = cur_cache->pf;
+	for(int i = 0; i < pf->degree; i++) {
+		prefetch_block(para, cur_cache, block + stride * (pf->distance + i), cnt);
+	}
+}
+
+/* Stride table entry of region, it may hold another region */
+static inline rpt_entry *stride_entry(prefetcher *pf, unsigned long long int region) {
+	return &pf->rpt[block_hash(region) & (RPT_ENTRIES - 1)];
+}
+
+/* 
+ * Train the stride table on every access, prefetch along a steady
+ * stride. Without IPs entries are keyed by region, and an access to a
+ * region with no entry carries on the stream of a neighbouring region,
+ * so strides up to the region size train across region boundaries.
+ */
+static void stride_train(cache_parameter *para, cache *cur_cache, 
+		unsigned long long int block, unsigned long long int cnt) {
+	prefetcher *pf = cur_cache->pf;
+	unsigned long long int region = (block << para->b) >> RPT_REGION_BITS;
+	rpt_entry *e = stride_entry(pf, region);
+	if(e->region != region) {
+		rpt_entry *from = NULL;
+		for(int d = -1; d <= 1; d += 2) {
+			rpt_entry *n = stride_entry(pf, region + d);
+			if(n->region == region + d && (from == NULL 
+					|| llabs((long long int)(block - n->last)) < llabs((long long int)(block - from->last)))) {
+				from = n;
+			}
+		}
+		e->region = region;
+		if(from == NULL) {
+			e->last = block;
+			e->stride = 0;
+			e->confidence = 0;
+			return;
+		}
+		e->last = from->last;
+		e->stride = from->stride;
+		e->confidence = from->confidence;
+	}
+	long long int delta = (long long int)(block - e->last);
+	if(delta == 0) {
+		return;
+	}
+	if(delta == e->stride) {
+		if(e->confidence < RPT_STEADY) {
+			e->confidence++;
+		}
+	}else {
+		e->stride = delta;
+		e->confidence = 0;
+	}
+	e->last = block;
+	if(e->confidence == RPT_STEADY) {
+		prefetch_run(para, cur_cache, block, delta, cnt);
+	}
+}
+
+/* 
+ * Follow streams on each trigger: a trigger a few blocks past a stream's
+ * last one advances it and tops its prefetches up to distance + degree
+ * blocks ahead, a trigger next to an unconfirmed one sets its direction,
+ * any other starts a new unconfirmed stream in the least recent tracker
+ */
+static void stream_train(cache_parameter *para, cache *cur_cache, 
+		unsigned long long int block, unsigned long long int cnt) {
+	prefetcher *pf = cur_cache->pf;
+	long long int window = pf->distance + pf->degree;
+	stream_tracker *lru = &pf->streams[0];
+	for(int i = 0; i < STREAM_TRACKERS; i++) {
+		stream_tracker *t = &pf->streams[i];
+		long long int delta = (long long int)(block - t->last);
+		if(t->used != 0 && t->dir == 0 && (delta == 1 || delta == -1)) {
+			t->dir = (int)delta;
+			t->front = block + t->dir * pf->distance;
+		}
+		if(t->used != 0 && t->dir != 0 && delta * t->dir > 0 && delta * t->dir <= window) {
+			t->last = block;
+			t->used = cnt;
+			// never prefetch closer than distance blocks ahead
+			long long int ahead = (long long int)(t->front - block) * t->dir;
+			if(ahead < pf->distance) {
+				t->front = block + t->dir * pf->distance;
+			}
+			while((long long int)(t->front - block) * t->dir < window) {
+				prefetch_block(para, cur_cache, t->front, cnt);
+				t->front += t->dir;
+			}
+			return;
+		}
+		if(t->used < lru->used) {
+			lru = t;
+		}
+	}
+	lru->last = block;
+	lru->dir = 0;
+	lru->used = cnt;
+}
+
+/* 
+ * Account a demand access to the prefetcher and let the engine react.
+ * way is the line of the block after the access, -1 if it was not
+ * allocated. Next-line and stream engines trigger on misses and on the
+ * first demand hit to a prefetched line, the stride engine on every access.
+ */
+static void prefetch_observe(cache_parameter *para, cache *cur_cache, 
+		unsigned long long int addr, unsigned long long int cnt, int result, int way) {
+	prefetcher *pf = cur_cache->pf;
+	unsigned long long int block = addr >> para->b;
+	int trigger = result != ACCESS_HIT;
+	pf->demand_line = (size_t)-1;
+	if(way >= 0) {
+		size_t line = (size_t)get_set(addr, *para) * para->E + way;
+		pf->demand_line = line;
+		if(pf->issued_at[line] != 0) {
+			if(result != ACCESS_HIT) {
+				// the demand fill replaced an unused prefetch
+				pf->useless++;
+			}else if(cnt - pf->issued_at[line] < (unsigned long long int)pf->latency) {
+				pf->late++;
+				trigger = 1;
+			}else {
+				pf->useful++;
+				trigger = 1;
+			}
+			pf->issued_at[line] = 0;
+		}
+	}
+	if(result != ACCESS_HIT && pf->victims.n != 0) {
+		unsigned long long int before = pf->victims.n;
+		block_map_remove(&pf->victims, block);
+		pf->polluting += before != pf->victims.n;
+	}
+	if(pf->engine == PF_STRIDE) {
+		stride_train(para, cur_cache, block, cnt);
+	}else if(trigger && pf->engine == PF_NEXT_LINE) {
+		prefetch_run(para, cur_cache, block, 1, cnt);
+	}else if(trigger) {
+		stream_train(para, cur_cache, block, cnt);
+	}
+}
+
+/* 
+ * access_cache of a skewed cache. Way w of the block lives in set
+ * skew_set(block, w), the lines are the E candidates across those sets
+ * and the victim is the least recent of them, by last use under LRU and
+ * by fill under FIFO.
+ */
+static int access_skewed(cache_parameter *para, cache *cur_cache, 
+		unsigned long long int addr, int size, unsigned long long int cnt, int is_store, 
+		unsigned long long int *evicted) {
+	unsigned long long int block = addr >> para->b;
+	int E = para->E;
+	size_t victim = 0, victim_set = 0;
+	int victim_way = 0, found_empty = 0;
+	for(int w = 0; w < E; w++) {
+		size_t set = skew_set(block, w, para->s);
+		size_t idx = set * E + w;
+		if(cur_cache->valid[idx] && cur_cache->tags[idx] == block) {
+			para->hit_count++;
+			cur_cache->policy->on_hit(cur_cache, set, w, cnt);
+			if(is_store) {
+				if(para->write_back) {
+					cur_cache->dirty[idx] = 1;
+				}else {
+					para->bytes_written += size;
+				}
+			}
+			return ACCESS_HIT;
+		}
+		if(found_empty) {
+			continue;
+		}
+		if(!cur_cache->valid[idx] || w == 0 || cur_cache->recency[idx] < cur_cache->recency[victim]) {
+			victim = idx;
+			victim_set = set;
+			victim_way = w;
+			found_empty = !cur_cache->valid[idx];
+		}
+	}
+	para->miss_count++;
+	if(is_store && !para->write_allocate) {
+		para->bytes_written += size;
+		return ACCESS_MISS;
+	}
+	int result = ACCESS_MISS;
+	para->bytes_read += 1ULL << para->b;
+	if(cur_cache->valid[victim]) {
+		para->eviction_count++;
+		*evicted = cur_cache->tags[victim] << para->b;
+		if(cur_cache->dirty[victim]) {
+			para->dirty_eviction_count++;
+			para->bytes_written += 1ULL << para->b;
+		}
+		result = ACCESS_EVICT;
+	}
+	cur_cache->valid[victim] = 1;
+	cur_cache->tags[victim] = block;
+	cur_cache->dirty[victim] = is_store && para->write_back;
+	cur_cache->policy->on_fill(cur_cache, victim_set, victim_way, cnt);
+	if(is_store && !para->write_back) {
+		para->bytes_written += size;
+	}
+	return result;
+}
+
+/* 
+ * Load or store size bytes at addr under the cache's write policy, return
+ * ACCESS_HIT, ACCESS_MISS or ACCESS_EVICT (then *evicted is the block).
+ * Stores mark the line dirty under write-back, and go straight to the
+ * next level under write-through or on a no-write-allocate miss.
+ */
+static inline int access_cache(cache_parameter *para, cache *cur_cache, 
+		unsigned long long int addr, int size, unsigned long long int cnt, int is_store, 
+		unsigned long long int *evicted) {
+	int empty;
+	int result = ACCESS_HIT;
+	if(para->index == INDEX_SKEW) {
+		return access_skewed(para, cur_cache, addr, size, cnt, is_store, evicted);
+	}
+	int way = probe_cache(para, cur_cache, addr, cnt, &empty);
+	if(way < 0) {
+		if(is_store && !para->write_allocate) {
+			para->bytes_written += size;
+			if(cur_cache->pf != NULL) {
+				prefetch_observe(para, cur_cache, addr, cnt, ACCESS_MISS, -1);
+			}
+			return ACCESS_MISS;
+		}
+		result = fill_cache(para, cur_cache, addr, cnt, empty, evicted, &way) 
+				? ACCESS_EVICT : ACCESS_MISS;
+	}
+	// before any prefetch, which may fill the same set
+	if(is_store) {
+		if(para->write_back) {
+			cur_cache->dirty[(size_t)get_set(addr, *para) * para->E + way] = 1;
+		}else {
+			para->bytes_written += size;
+		}
+	}
+	if(cur_cache->pf != NULL) {
+		prefetch_observe(para, cur_cache, addr, cnt, result, way);
+	}
+	return result;
+}
+
+/* Verbose output of each access result */
+static const char *access_names[] = {"hit", "miss", "miss eviction"};
+
+/* Function for visiting cache, and update count number for output */
+cache_parameter visit_cache(cache_parameter para, cache *cur_cache, 
+			unsigned long long int addr, unsigned long long int cnt, int verbo) {
+	unsigned long long int evicted;
+	int result = access_cache(&para, cur_cache, addr, 0, cnt, 0, &evicted);
+	if(verbo == 1) {
+		printf("%s\n", access_names[result]);
+	}
+	return para;	
+}
+
+/* Function for storing size bytes through the cache */
+cache_parameter store_cache(cache_parameter para, cache *cur_cache, 
+			unsigned long long int addr, int size, unsigned long long int cnt, int verbo) {
+	unsigned long long int evicted;
+	int result = access_cache(&para, cur_cache, addr, size, cnt, 1, &evicted);
+	if(verbo == 1) {
+		printf("%s\n", access_names[result]);
+	}
+	return para;	
+}
+
+/* Function for one trace record: L loads, S stores, M loads then stores */
+cache_parameter visit_op(cache_parameter para, cache *cur_cache, char op, 
+			unsigned long long int addr, int size, unsigned long long int cnt, int verbo) {
+	if(op == 'L' || op == 'M') {
+		para = visit_cache(para, cur_cache, addr, cnt, verbo);
+	}
+	if(op == 'S' || op == 'M') {
+		para = store_cache(para, cur_cache, addr, size, cnt, verbo);
+	}
+	return para;
+}
+
+/* 
+ * Function for a run of n records with the same op and size to one
+ * block. The first is visited normally, the rest are hits on the line
+ * it left, so only the policy's hit update runs for them. Runs whose
+ * block is not cached afterwards, no-write-allocate stores, are
+ * visited record by record.
+ */
+cache_parameter visit_run(cache_parameter para, cache *cur_cache, access_run *run) {
+	para = visit_op(para, cur_cache, run->op, run->addr, run->size, run->cnt, 0);
+	if(run->n == 1) {
+		return para;
+	}
+	int way = find_block(para, cur_cache, run->addr);
+	if(way < 0) {
+		for(unsigned long long int i = 1; i < run->n; i++) {
+			para = visit_op(para, cur_cache, run->op, run->addr, run->size, run->cnt + i, 0);
+		}
+		return para;
+	}
+	size_t set = get_set(run->addr, para);
+	int per = run->op == 'M' ? 2 : 1;  // an M is a load then a store
+	for(unsigned long long int i = 1; i < run->n; i++) {
+		for(int k = 0; k < per; k++) {
+			cur_cache->policy->on_hit(cur_cache, set, way, run->cnt + i);
+		}
+	}
+	para.hit_count += (long)(run->n - 1) * per;
+	if((run->op == 'S' || run->op == 'M') && !para.write_back) {
+		para.bytes_written += (run->n - 1) * run->size;
+	}
+	return para;
+}
+
+/* Zero the output counts of para */
+void reset_counts(cache_parameter *para) {
+	para->hit_count = 0;
+	para->miss_count = 0;
+	para->eviction_count = 0;
+	para->dirty_eviction_count = 0;
+	para->bytes_read = 0;
+	para->bytes_written = 0;
+}
+
+/* 
+ * Visit a hierarchy of n levels, level 0 being L1. Non-inclusive and
+ * inclusive hierarchies fill the block into every level that missed,
+ * inclusive ones also back-invalidate the upper levels when a lower one
+ * evicts, every upper block inside the evicted one. Exclusive
+ * hierarchies fill only L1, a block hit below moves up and each level's
+ * victim drops into the level below it, so main gives them one block
+ * size. Return the level that had the block, n for memory.
+ */
+int visit_hierarchy(cache_level *levels, int n, int inclusion, 
+		unsigned long long int addr, unsigned long long int cnt, int verbo) {
+	int empty[MAX_LEVELS];
+	int hit_level = n;
+	unsigned long long int evicted;
+	for(int i = 0; i < n; i++) {
+		if(probe_cache(&levels[i].para, &levels[i].c, addr, cnt, &empty[i]) >= 0) {
+			hit_level = i;
+			break;
+		}
+	}
+	if(verbo == 1) {
+		for(int i = 0; i < hit_level; i++) {
+			printf("L%d miss ", i + 1);
+		}
+		if(hit_level < n) {
+			printf("L%d hit\n", hit_level + 1);
+		}else {
+			printf("memory\n");
+		}
+	}
+	if(hit_level == 0) {
+		return 0;
+	}
+	if(inclusion == INCL_EXCLUSIVE) {
+		if(hit_level < n) {
+			invalidate_block(levels[hit_level].para, &levels[hit_level].c, addr);
+		}
+		// cascade victims down, each lower level acts as victim cache
+		unsigned long long int block = addr;
+		int slot = empty[0];
+		for(int i = 0; i < n; i++) {
+			if(!fill_cache(&levels[i].para, &levels[i].c, block, cnt, slot, &evicted, NULL)) {
+				break;
+			}
+			block = evicted;
+			slot = FIND_EMPTY;
+		}
+		return hit_level;
+	}
+	for(int i = hit_level - 1; i >= 0; i--) {
+		if(fill_cache(&levels[i].para, &levels[i].c, addr, cnt, empty[i], &evicted, NULL) 
+				&& inclusion == INCL_INCLUSIVE) {
+			unsigned long long int end = evicted + (1ULL << levels[i].para.b);
+			for(int j = 0; j < i; j++) {
+				// upper blocks are no larger, main checks that
+				for(unsigned long long int a = evicted; a < end; a += 1ULL << levels[j].para.b) {
+					if(invalidate_block(levels[j].para, &levels[j].c, a)) {
+						levels[j].back_invalidations++;
+						// that level's probe result is stale now, it may have a free way
+						empty[j] = FIND_EMPTY;
+					}
+				}
+			}
+		}
+	}
+	return hit_level;
+}
+
+/* Shard owning the set of addr, shards own equal ranges of sets */
+static inline int shard_of(unsigned long long int addr, cache_parameter para, int n) {
+	return (int)(((unsigned long long int)get_set(addr, para) * n) >> para.s);
+}
+
+/* Worker of a shard, replays the shard's chunks against its own sets */
+static void *shard_main(void *arg) {
+	sim_shard *shard = (sim_shard*)arg;
+	for(;;) {
+		pthread_mutex_lock(&shard->lock);
+		while(shard->count == 0 && !shard->done) {
+			pthread_cond_wait(&shard->cond, &shard->lock);
+		}
+		if(shard->count == 0) {
+			pthread_mutex_unlock(&shard->lock);
+			return NULL;
+		}
+		shard_chunk *chunk = &shard->ring[shard->head];
+		pthread_mutex_unlock(&shard->lock);
+		for(int i = 0; i < chunk->n; i++) {
+			shard_access *acc = &chunk->acc[i];
+			shard->para = visit_op(shard->para, shard->c, acc->op, acc->addr, acc->size, acc->cnt, 0);
+		}
+		pthread_mutex_lock(&shard->lock);
+		shard->head = (shard->head + 1) % SHARD_QUEUE;
+		shard->count--;
+		pthread_cond_signal(&shard->cond);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/* Hand the chunk being filled to the worker, wait for a free one */
+static void shard_publish(sim_shard *shard) {
+	pthread_mutex_lock(&shard->lock);
+	shard->count++;
+	pthread_cond_signal(&shard->cond);
+	while(shard->count == SHARD_QUEUE) {
+		pthread_cond_wait(&shard->cond, &shard->lock);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	shard->tail = (shard->tail + 1) % SHARD_QUEUE;
+	shard->ring[shard->tail].n = 0;
+}
+
+/* 
+ * Simulate the trace on n threads. Sets never interact, so the reader
+ * routes each access to the thread owning its set, tagged with its
+ * serial access time, and every thread sees its sets' accesses in trace
+ * order. The merged counts match the serial run exactly. Records are
+ * split into blocks of 2^span_bits bytes first, see next_piece.
+ */
+cache_parameter simulate_sharded(cache_parameter para, cache *cur_cache, 
+		trace_reader *reader, int n, int span_bits) {
+	sim_shard *shards = (sim_shard*)calloc(n, sizeof(sim_shard));
+	trace_record rec, piece;
+	unsigned long long int cnt = 1;  // record access time
+	for(int i = 0; i < n; i++) {
+		shards[i].c = cur_cache;
+		shards[i].para = para;
+		reset_counts(&shards[i].para);
+		shards[i].ring = (shard_chunk*)malloc(sizeof(shard_chunk) * SHARD_QUEUE);
+		shards[i].ring[0].n = 0;
+		pthread_mutex_init(&shards[i].lock, NULL);
+		pthread_cond_init(&shards[i].cond, NULL);
+		pthread_create(&shards[i].thread, NULL, shard_main, &shards[i]);
+	}
+	while(next_record(reader, &rec)) {
+		if(rec.op == 'L' || rec.op == 'S' || rec.op == 'M') {
+			while(next_piece(&rec, span_bits, &piece)) {
+				sim_shard *shard = &shards[shard_of(piece.addr, para, n)];
+				shard_chunk *chunk = &shard->ring[shard->tail];
+				shard_access *acc = &chunk->acc[chunk->n++];
+				acc->addr = piece.addr;
+				acc->cnt = cnt;
+				acc->size = piece.size;
+				acc->op = piece.op;
+				if(chunk->n == SHARD_CHUNK) {
+					shard_publish(shard);
+				}
+			}
+		}
+		cnt++;
+	}
+	for(int i = 0; i < n; i++) {
+		pthread_mutex_lock(&shards[i].lock);
+		if(shards[i].ring[shards[i].tail].n > 0) {
+			shards[i].count++;
+		}
+		shards[i].done = 1;
+		pthread_cond_signal(&shards[i].cond);
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+	for(int i = 0; i < n; i++) {
+		pthread_join(shards[i].thread, NULL);
+		para.hit_count += shards[i].para.hit_count;
+		para.miss_count += shards[i].para.miss_count;
+		para.eviction_count += shards[i].para.eviction_count;
+		para.dirty_eviction_count += shards[i].para.dirty_eviction_count;
+		para.bytes_read += shards[i].para.bytes_read;
+		para.bytes_written += shards[i].para.bytes_written;
+		pthread_mutex_destroy(&shards[i].lock);
+		pthread_cond_destroy(&shards[i].cond);
+		free(shards[i].ring);
+	}
+	free(shards);
+	return para;
+}
+
+/* Size of the treap rooted at node t */
+static inline unsigned int treap_size(sd_engine *sd, unsigned int t) {
+	return t ? sd->nodes[t].size : 0;
+}
+
+/* Recompute the size of node t from its children */
+static inline void treap_update(sd_engine *sd, unsigned int t) {
+	sd->nodes[t].size = 1 + treap_size(sd, sd->nodes[t].left) + treap_size(sd, sd->nodes[t].right);
+}
+
+/* Split treap t into keys below key (*l) and keys at or above it (*r) */
+static void treap_split(sd_engine *sd, unsigned int t, unsigned long long int key, 
+		unsigned int *l, unsigned int *r) {
+	if(t == 0) {
+		*l = *r = 0;
+	}else if(sd->nodes[t].key < key) {
+		treap_split(sd, sd->nodes[t].right, key, &sd->nodes[t].right, r);
+		*l = t;
+		treap_update(sd, t);
+	}else {
+		treap_split(sd, sd->nodes[t].left, key, l, &sd->nodes[t].left);
+		*r = t;
+		treap_update(sd, t);
+	}
+}
+
+/* Merge treaps l and r, every key of l below every key of r */
+static unsigned int treap_merge(sd_engine *sd, unsigned int l, unsigned int r) {
+	if(l == 0 || r == 0) {
+		return l ? l : r;
+	}
+	if(sd->nodes[l].prio > sd->nodes[r].prio) {
+		sd->nodes[l].right = treap_merge(sd, sd->nodes[l].right, r);
+		treap_update(sd, l);
+		return l;
+	}
+	sd->nodes[r].left = treap_merge(sd, l, sd->nodes[r].left);
+	treap_update(sd, r);
+	return r;
+}
+
+/* Take a fresh node keyed by time */
+static unsigned int treap_node(sd_engine *sd, unsigned long long int time) {
+	if(sd->n_nodes == sd->cap_nodes) {
+		sd->cap_nodes *= 2;
+		sd->nodes = (sd_node*)realloc(sd->nodes, sizeof(sd_node) * sd->cap_nodes);
+	}
+	unsigned int t = sd->n_nodes++;
+	// xorshift priorities keep the treap balanced in expectation
+	sd->seed ^= sd->seed << 13;
+	sd->seed ^= sd->seed >> 17;
+	sd->seed ^= sd->seed << 5;
+	sd->nodes[t].key = time;
+	sd->nodes[t].prio = sd->seed;
+	sd->nodes[t].size = 1;
+	sd->nodes[t].left = sd->nodes[t].right = 0;
+	return t;
+}
+
+/* 
+ * Move node t of the tree at *root from its old last-access time to
+ * time, the newest key. Return the stack distance: the number of
+ * distinct blocks of the tree touched since t was last touched.
+ */
+static unsigned int treap_touch(sd_engine *sd, unsigned int *root, unsigned int t, 
+		unsigned long long int time) {
+	unsigned int below, rest, self, above;
+	unsigned long long int old = sd->nodes[t].key;
+	treap_split(sd, *root, old, &below, &rest);
+	treap_split(sd, rest, old + 1, &self, &above);
+	unsigned int distance = treap_size(sd, above);
+	sd->nodes[t].key = time;
+	sd->nodes[t].size = 1;
+	sd->nodes[t].left = sd->nodes[t].right = 0;
+	*root = treap_merge(sd, treap_merge(sd, below, above), t);
+	return distance;
+}
+
+/* Find the slot of block in the block table, or the empty slot it would take */
+static sd_block *sd_lookup(sd_engine *sd, unsigned long long int block) {
+	size_t mask = sd->cap_blocks - 1;
+	size_t i = block_hash(block) & mask;
+	while(sd->blocks[i].fa_node != 0 && sd->blocks[i].block != block) {
+		i = (i + 1) & mask;
+	}
+	return &sd->blocks[i];
+}
+
+/* Double the block table once it is half full */
+static void sd_grow(sd_engine *sd) {
+	sd_block *old = sd->blocks;
+	size_t old_cap = sd->cap_blocks;
+	sd->cap_blocks *= 2;
+	sd->blocks = (sd_block*)calloc(sd->cap_blocks, sizeof(sd_block));
+	for(size_t i = 0; i < old_cap; i++) {
+		if(old[i].fa_node != 0) {
+			*sd_lookup(sd, old[i].block) = old[i];
+		}
+	}
+	free(old);
+}
+
+/* Whether the block of addr is in the engine's sample */
+static inline int sd_sampled(sd_engine *sd, unsigned long long int addr) {
+	return sd->sample_max == 0 || block_hash(addr >> sd->b) < SD_HASH_RANGE >> sd->sample_shift;
+}
+
+/* Order block_slot entries by key, the last access time */
+static int compare_slot_key(const void *x, const void *y) {
+	unsigned long long int a = ((const block_slot*)x)->key, b = ((const block_slot*)y)->key;
+	return a < b ? -1 : a > b;
+}
+
+/* 
+ * Halve the sample rate once more than sample_max blocks are held, as
+ * fixed size SHARDS does: keep the blocks still in the sample and
+ * rebuild the tree from them, oldest first.
+ */
+static void sd_halve(sd_engine *sd) {
+	block_slot *kept = (block_slot*)malloc(sizeof(block_slot) * sd->n_blocks);
+	size_t n = 0;
+	sd->sample_shift++;
+	for(size_t i = 0; i < sd->cap_blocks; i++) {
+		if(sd->blocks[i].fa_node != 0 && sd_sampled(sd, sd->blocks[i].block << sd->b)) {
+			kept[n].key = sd->nodes[sd->blocks[i].fa_node].key;
+			kept[n++].val = sd->blocks[i].block;
+		}
+	}
+	qsort(kept, n, sizeof(block_slot), compare_slot_key);
+	memset(sd->blocks, 0, sizeof(sd_block) * sd->cap_blocks);
+	sd->n_nodes = 1;
+	sd->fa_root = 0;
+	for(size_t i = 0; i < n; i++) {
+		sd_block *entry = sd_lookup(sd, kept[i].val);
+		entry->block = kept[i].val;
+		entry->fa_node = treap_node(sd, kept[i].key);
+		sd->fa_root = treap_merge(sd, sd->fa_root, entry->fa_node);
+	}
+	sd->n_blocks = n;
+	free(kept);
+}
+
+/* 
+ * Set up the engine for sets of 2^s and blocks of 2^b bytes, s -1 for
+ * the fully associative curve only. A nonzero sample_max bounds the
+ * blocks held by sampling them, fully associative only.
+ */
+void init_stack_distance(sd_engine *sd, int s, int b, unsigned long long int sample_max) {
+	memset(sd, 0, sizeof(*sd));
+	sd->s = s;
+	sd->b = b;
+	sd->sample_max = sample_max;
+	sd->seed = 0x2545f4914f6cdd1dULL;
+	sd->cap_nodes = 1024;
+	sd->nodes = (sd_node*)malloc(sizeof(sd_node) * sd->cap_nodes);
+	sd->n_nodes = 1;  // node 0 is the empty tree
+	sd->cap_blocks = 1024;
+	sd->blocks = (sd_block*)calloc(sd->cap_blocks, sizeof(sd_block));
+	if(s >= 0) {
+		sd->set_roots = (unsigned int*)calloc((size_t)1 << s, sizeof(unsigned int));
+	}
+}
+
+/* 
+ * Account one access to addr in the fully associative stack and, if
+ * kept, the per set stacks. Return its fully associative distance,
+ * scaled up by the sample rate, -1 on a first touch or SD_UNSAMPLED
+ * if the block is outside the sample.
+ */
+long long int stack_distance_access(sd_engine *sd, unsigned long long int addr) {
+	unsigned long long int block = addr >> sd->b;
+	if(!sd_sampled(sd, addr)) {
+		return SD_UNSAMPLED;
+	}
+	unsigned int *set_root = sd->set_roots ? &sd->set_roots[block & (((unsigned long long int)1 << sd->s) - 1)] : NULL;
+	unsigned long long int time = ++sd->accesses;
+	sd_block *entry = sd_lookup(sd, block);
+	if(entry->fa_node != 0 && block == sd->last_block) {
+		// distance 0, the nodes already hold the largest keys so they move up in place
+		sd->nodes[entry->fa_node].key = time;
+		sd->fa_hist[0]++;
+		if(set_root != NULL) {
+			sd->nodes[entry->set_node].key = time;
+			sd->set_hist[0]++;
+		}
+		return 0;
+	}
+	sd->last_block = block;
+	if(entry->fa_node == 0) {
+		// first touch, a miss at every size
+		sd->cold++;
+		entry->block = block;
+		entry->fa_node = treap_node(sd, time);
+		sd->fa_root = treap_merge(sd, sd->fa_root, entry->fa_node);
+		if(set_root != NULL) {
+			entry->set_node = treap_node(sd, time);
+			*set_root = treap_merge(sd, *set_root, entry->set_node);
+		}
+		if(++sd->n_blocks * 2 > sd->cap_blocks) {
+			sd_grow(sd);
+		}
+		if(sd->sample_max != 0 && sd->n_blocks > sd->sample_max) {
+			sd_halve(sd);
+		}
+		return -1;
+	}
+	unsigned int fa_distance = treap_touch(sd, &sd->fa_root, entry->fa_node, time);
+	sd->fa_hist[fa_distance == 0 ? 0 : 32 - __builtin_clz(fa_distance)]++;
+	if(set_root != NULL) {
+		unsigned int distance = treap_touch(sd, set_root, entry->set_node, time);
+		sd->set_hist[distance < SD_MAX_WAYS ? distance : SD_MAX_WAYS]++;
+	}
+	return (long long int)fa_distance << sd->sample_shift;
+}
+
+/* 
+ * Print the miss ratio curves. An LRU cache of C lines misses exactly
+ * on the accesses with stack distance C or more, so the fully
+ * associative curve comes from the log2 distance buckets and the
+ * curve over associativity from the exact per set distances.
+ */
+void print_stack_distance(sd_engine *sd) {
+	unsigned long long int total = sd->accesses ? sd->accesses : 1;
+	unsigned long long int misses = sd->accesses;
+	printf("# fully associative LRU, %d byte blocks, %llu accesses, %llu blocks\n", 
+			1 << sd->b, sd->accesses, sd->n_blocks);
+	printf("lines,bytes,misses,miss_ratio\n");
+	// bucket k holds distances in [2^(k-1), 2^k), hits at capacity 2^k cover buckets 0..k
+	for(int k = 0; k < SD_BUCKETS - 1; k++) {
+		misses -= sd->fa_hist[k];
+		printf("%llu,%llu,%llu,%.6f\n", 1ULL << k, (1ULL << k) << sd->b, misses, 
+				(double)misses / total);
+		if(misses == sd->cold) {
+			break;
+		}
+	}
+	misses = sd->accesses;
+	printf("# %d sets LRU, %d byte blocks\n", 1 << sd->s, 1 << sd->b);
+	printf("ways,bytes,misses,miss_ratio\n");
+	for(int e = 1; e <= SD_MAX_WAYS; e++) {
+		misses -= sd->set_hist[e - 1];
+		printf("%d,%llu,%llu,%.6f\n", e, ((unsigned long long int)e << sd->s) << sd->b, 
+				misses, (double)misses / total);
+		if(misses == sd->cold) {
+			break;
+		}
+	}
+}
+
+/* Free the engine */
+void free_stack_distance(sd_engine *sd) {
+	free(sd->nodes);
+	free(sd->blocks);
+	free(sd->set_roots);
+}
+
+/* Set up an empty block map */
+void init_block_map(block_map *map) {
+	map->cap = 1024;
+	map->n = 0;
+	map->slots = (block_slot*)malloc(sizeof(block_slot) * map->cap);
+	memset(map->slots, 0xff, sizeof(block_slot) * map->cap);
+}
+
+/* Slot of block in the map, or the empty slot it would take */
+static inline block_slot *block_map_slot(block_map *map, unsigned long long int block) {
+	size_t mask = map->cap - 1;
+	size_t i = block_hash(block) & mask;
+	while(map->slots[i].key != block && map->slots[i].key != BLOCK_MAP_EMPTY) {
+		i = (i + 1) & mask;
+	}
+	return &map->slots[i];
+}
+
+/* 
+ * Value slot of block, inserted with value 0 if missing. *fresh tells
+ * whether it was missing. The pointer is valid until the next insert.
+ */
+unsigned long long int *block_map_get(block_map *map, unsigned long long int block, int *fresh) {
+	block_slot *slot = block_map_slot(map, block);
+	*fresh = slot->key == BLOCK_MAP_EMPTY;
+	if(!*fresh) {
+		return &slot->val;
+	}
+	if((map->n + 1) * 2 > map->cap) {
+		// keep it at most half full, rehash into twice the slots
+		block_slot *old = map->slots;
+		size_t cap = map->cap;
+		map->cap *= 2;
+		map->slots = (block_slot*)malloc(sizeof(block_slot) * map->cap);
+		memset(map->slots, 0xff, sizeof(block_slot) * map->cap);
+		for(size_t j = 0; j < cap; j++) {
+			if(old[j].key != BLOCK_MAP_EMPTY) {
+				*block_map_slot(map, old[j].key) = old[j];
+			}
+		}
+		free(old);
+		slot = block_map_slot(map, block);
+	}
+	map->n++;
+	slot->key = block;
+	slot->val = 0;
+	return &slot->val;
+}
+
+/* Free the map */
+void free_block_map(block_map *map) {
+	free(map->slots);
+}
+
+/* Remove block from the map if present, shifting later probes back into the hole */
+void block_map_remove(block_map *map, unsigned long long int block) {
+	size_t mask = map->cap - 1;
+	block_slot *slot = block_map_slot(map, block);
+	if(slot->key == BLOCK_MAP_EMPTY) {
+		return;
+	}
+	size_t hole = slot - map->slots;
+	for(size_t j = (hole + 1) & mask; map->slots[j].key != BLOCK_MAP_EMPTY; j = (j + 1) & mask) {
+		size_t home = block_hash(map->slots[j].key) & mask;
+		// slot j may move to the hole unless its home lies cyclically in (hole, j]
+		if(((j - home) & mask) >= ((j - hole) & mask)) {
+			map->slots[hole] = map->slots[j];
+			hole = j;
+		}
+	}
+	map->slots[hole].key = BLOCK_MAP_EMPTY;
+	map->n--;
+}
+
+/* 
+ * Open one trace per core and give each core a private cache of the
+ * geometry in para, return 0 on success or -1 if a trace cannot be opened
+ */
+int init_coherence(coherence_sim *sim, cache_parameter para, char **paths, int n, int moesi) {
+	size_t lines = ((size_t)1 << para.s) * para.E;
+	sim->cores = (core_cache*)calloc(n, sizeof(core_cache));
+	sim->n = n;
+	sim->moesi = moesi;
+	init_block_map(&sim->lines);
+	sim->n_lines = 0;
+	sim->cap_lines = 1024;
+	sim->traffic = (line_traffic*)malloc(sizeof(line_traffic) * sim->cap_lines);
+	sim->invalidations = sim->upgrades = sim->transfers = sim->flushes = 0;
+	for(int i = 0; i < n; i++) {
+		core_cache *core = &sim->cores[i];
+		core->para = para;
+		reset_counts(&core->para);
+		core->c = init_cache(para);
+		core->state = (unsigned char*)calloc(lines, 1);
+		core->done = 1;
+		if(open_trace(&core->reader, paths[i]) != 0) {
+			printf("trace file %s cannot be opened.\n", paths[i]);
+			return -1;
+		}
+		core->done = 0;
+	}
+	return 0;
+}
+
+/* Traffic counters of block, added the first time it is touched */
+static line_traffic *line_of(coherence_sim *sim, unsigned long long int block) {
+	int fresh;
+	unsigned long long int *idx = block_map_get(&sim->lines, block, &fresh);
+	if(fresh) {
+		if(sim->n_lines == sim->cap_lines) {
+			sim->cap_lines *= 2;
+			sim->traffic = (line_traffic*)realloc(sim->traffic, 
+					sizeof(line_traffic) * sim->cap_lines);
+		}
+		*idx = sim->n_lines++;
+		memset(&sim->traffic[*idx], 0, sizeof(line_traffic));
+		sim->traffic[*idx].block = block;
+	}
+	return &sim->traffic[*idx];
+}
+
+/* Snoop results */
+#define SNOOP_HELD 1  // another cache holds the block
+#define SNOOP_SUPPLIED 2  // and can send it, so memory is not read
+
+/* 
+ * Broadcast a bus read, or a read for ownership if exclusive, from core
+ * id to the other caches. A read demotes the other copies to shared, a
+ * modified one is written back under MESI and becomes owned under MOESI.
+ * A read for ownership invalidates them. Return the SNOOP_ flags.
+ */
+static int snoop(coherence_sim *sim, int id, unsigned long long int addr, int exclusive, 
+		line_traffic *lt) {
+	int flags = 0;
+	for(int i = 0; i < sim->n; i++) {
+		core_cache *peer = &sim->cores[i];
+		int way = i == id ? -1 : find_block(peer->para, &peer->c, addr);
+		if(way < 0) {
+			continue;
+		}
+		size_t line = (size_t)get_set(addr, peer->para) * peer->para.E + way;
+		unsigned char st = peer->state[line];
+		flags |= SNOOP_HELD;
+		// shared copies stay quiet, memory or the owner answers
+		if(st != LINE_S) {
+			flags |= SNOOP_SUPPLIED;
+		}
+		if(exclusive) {
+			// dirty data moves to the writer, nothing is written back
+			peer->c.valid[line] = 0;
+			peer->c.dirty[line] = 0;
+			peer->state[line] = LINE_I;
+			lt->invalidations++;
+			sim->invalidations++;
+		}else if(st == LINE_M && sim->moesi) {
+			peer->state[line] = LINE_O;
+		}else if(st == LINE_M) {
+			peer->para.bytes_written += 1ULL << peer->para.b;
+			peer->c.dirty[line] = 0;
+			peer->state[line] = LINE_S;
+			sim->flushes++;
+		}else if(st == LINE_E) {
+			peer->state[line] = LINE_S;
+		}
+	}
+	return flags;
+}
+
+/* 
+ * Load or store by core id, keeping the other caches coherent. Return
+ * ACCESS_HIT, ACCESS_MISS or ACCESS_EVICT for the core's own cache.
+ * Dirty lines (M and O) carry the dirty bit, so their evictions are
+ * counted as write-backs like in a single cache.
+ */
+int coherent_access(coherence_sim *sim, int id, unsigned long long int addr, 
+		unsigned long long int cnt, int is_store) {
+	core_cache *core = &sim->cores[id];
+	cache_parameter *para = &core->para;
+	size_t base = (size_t)get_set(addr, *para) * para->E;
+	line_traffic *lt = line_of(sim, addr >> para->b);
+	lt->cores |= 1ULL << id;
+	int empty;
+	int way = probe_cache(para, &core->c, addr, cnt, &empty);
+	if(way >= 0) {
+		unsigned char st = core->state[base + way];
+		if(is_store && st != LINE_M) {
+			// shared and owned copies elsewhere must go first
+			if(st != LINE_E) {
+				snoop(sim, id, addr, 1, lt);
+				lt->upgrades++;
+				sim->upgrades++;
+			}
+			core->state[base + way] = LINE_M;
+			core->c.dirty[base + way] = 1;
+		}
+		return ACCESS_HIT;
+	}
+	int flags = snoop(sim, id, addr, is_store, lt);
+	if(flags & SNOOP_SUPPLIED) {
+		lt->transfers++;
+		sim->transfers++;
+	}
+	unsigned long long int evicted;
+	int result = fill_cache(para, &core->c, addr, cnt, empty, &evicted, &way) 
+			? ACCESS_EVICT : ACCESS_MISS;
+	if(is_store) {
+		core->state[base + way] = LINE_M;
+		core->c.dirty[base + way] = 1;
+	}else {
+		core->state[base + way] = (flags & SNOOP_HELD) ? LINE_S : LINE_E;
+	}
+	return result;
+}
+
+/* Read the next record of a core into its pending slot */
+static void core_advance(core_cache *core) {
+	if(next_record(&core->reader, &core->rec)) {
+		core->records++;
+		// records without a timestamp are ordered by their place in the trace
+		if(core->rec.ts == 0) {
+			core->rec.ts = core->records;
+		}
+	}else {
+		close_trace(&core->reader);
+		core->done = 1;
+	}
+}
+
+/* 
+ * Merge the per core traces round-robin or by timestamp and run every
+ * record through its core's cache
+ */
+void simulate_coherent(coherence_sim *sim, int order, int span_bits, int verbo) {
+	trace_record piece;
+	unsigned long long int cnt = 1;  // record access time, shared by all cores
+	int turn = 0;  // next core of a round-robin merge
+	for(int i = 0; i < sim->n; i++) {
+		core_advance(&sim->cores[i]);
+	}
+	for(;;) {
+		int id = -1;
+		if(order == ORDER_TIMESTAMP) {
+			for(int i = 0; i < sim->n; i++) {
+				if(!sim->cores[i].done && (id < 0 || sim->cores[i].rec.ts < sim->cores[id].rec.ts)) {
+					id = i;
+				}
+			}
+		}else {
+			for(int k = 0; k < sim->n && id < 0; k++) {
+				int i = (turn + k) % sim->n;
+				if(!sim->cores[i].done) {
+					id = i;
+				}
+			}
+			turn = (id + 1) % sim->n;
+		}
+		if(id < 0) {
+			break;
+		}
+		core_cache *core = &sim->cores[id];
+		trace_record rec = core->rec;
+		if(verbo == 1) {
+			printf("core%d %c %llx,%d ", id, rec.op, rec.addr, rec.size);
+		}
+		while(next_piece(&rec, span_bits, &piece)) {
+			if(piece.op == 'L' || piece.op == 'M') {
+				int result = coherent_access(sim, id, piece.addr, cnt, 0);
+				if(verbo == 1) {
+					printf("%s ", access_names[result]);
+				}
+			}
+			if(piece.op == 'S' || piece.op == 'M') {
+				int result = coherent_access(sim, id, piece.addr, cnt, 1);
+				if(verbo == 1) {
+					printf("%s ", access_names[result]);
+				}
+			}
+		}
+		if(verbo == 1) {
+			printf("\n");
+		}
+		cnt++;
+		core_advance(core);
+	}
+}
+
+/* Traffic of a line, the order of the hotspot report */
+static inline long line_events(const line_traffic *lt) {
+	return lt->invalidations + lt->upgrades + lt->transfers;
+}
+
+/* qsort order, busiest line first */
+static int busier_line(const void *a, const void *b) {
+	long ea = line_events((const line_traffic*)a);
+	long eb = line_events((const line_traffic*)b);
+	return (ea < eb) - (ea > eb);
+}
+
+/* 
+ * Print the counts of each core, the bus totals and the lines with the
+ * most coherence traffic. A line with many invalidations touched by
+ * several cores is a false sharing suspect.
+ */
+void print_coherence(coherence_sim *sim) {
+	long writebacks = sim->flushes;
+	for(int i = 0; i < sim->n; i++) {
+		cache_parameter *cp = &sim->cores[i].para;
+		printf("core%d hits:%ld misses:%ld evictions:%ld\n", i, 
+				cp->hit_count, cp->miss_count, cp->eviction_count);
+		writebacks += cp->dirty_eviction_count;
+	}
+	printf("invalidations:%ld upgrades:%ld c2c-transfers:%ld writebacks:%ld\n", 
+			sim->invalidations, sim->upgrades, sim->transfers, writebacks);
+	qsort(sim->traffic, sim->n_lines, sizeof(line_traffic), busier_line);
+	int b = sim->cores[0].para.b;
+	for(size_t i = 0; i < sim->n_lines && i < COHERENCE_TOP_LINES; i++) {
+		line_traffic *lt = &sim->traffic[i];
+		if(line_events(lt) == 0) {
+			break;
+		}
+		printf("line:0x%llx invalidations:%ld upgrades:%ld c2c-transfers:%ld cores:0x%llx\n", 
+				lt->block << b, lt->invalidations, lt->upgrades, lt->transfers, lt->cores);
+	}
+}
+
+/* Close the traces and free the caches */
+void free_coherence(coherence_sim *sim) {
+	for(int i = 0; i < sim->n; i++) {
+		core_cache *core = &sim->cores[i];
+		if(!core->done) {
+			close_trace(&core->reader);
+		}
+		free_cache(core->c, core->para);
+		free(core->state);
+	}
+	free(sim->cores);
+	free(sim->traffic);
+	free_block_map(&sim->lines);
+}
+
+/* Set up the classifier, the shadow cache holds as many lines as the real one */
+void init_classifier(miss_classifier *mc, cache_parameter para) {
+	mc->capacity = (unsigned int)(para.index_sets * para.E);
+	mc->used = 0;
+	mc->head = mc->tail = SHADOW_NIL;
+	mc->blocks = (unsigned long long int*)malloc(sizeof(unsigned long long int) * mc->capacity);
+	mc->prev = (unsigned int*)malloc(sizeof(unsigned int) * mc->capacity);
+	mc->next = (unsigned int*)malloc(sizeof(unsigned int) * mc->capacity);
+	init_block_map(&mc->seen);
+	init_block_map(&mc->where);
+	mc->compulsory = mc->capacity_misses = mc->conflict = 0;
+}
+
+/* Unlink shadow line i from the recency list */
+static inline void shadow_unlink(miss_classifier *mc, unsigned int i) {
+	if(mc->prev[i] != SHADOW_NIL) {
+		mc->next[mc->prev[i]] = mc->next[i];
+	}else {
+		mc->head = mc->next[i];
+	}
+	if(mc->next[i] != SHADOW_NIL) {
+		mc->prev[mc->next[i]] = mc->prev[i];
+	}else {
+		mc->tail = mc->prev[i];
+	}
+}
+
+/* Link shadow line i in as most recently used */
+static inline void shadow_push(miss_classifier *mc, unsigned int i) {
+	mc->prev[i] = SHADOW_NIL;
+	mc->next[i] = mc->head;
+	if(mc->head != SHADOW_NIL) {
+		mc->prev[mc->head] = i;
+	}else {
+		mc->tail = i;
+	}
+	mc->head = i;
+}
+
+/* 
+ * Access block in the fully associative LRU shadow cache, return 1 on a
+ * hit. The map finds the line and the list keeps recency, both O(1).
+ */
+static int shadow_access(miss_classifier *mc, unsigned long long int block) {
+	int fresh;
+	unsigned long long int *where = block_map_get(&mc->where, block, &fresh);
+	if(!fresh) {
+		unsigned int i = (unsigned int)*where;
+		if(i != mc->head) {
+			shadow_unlink(mc, i);
+			shadow_push(mc, i);
+		}
+		return 1;
+	}
+	unsigned int i;
+	if(mc->used < mc->capacity) {
+		i = mc->used++;
+	}else {
+		i = mc->tail;
+		shadow_unlink(mc, i);
+		block_map_remove(&mc->where, mc->blocks[i]);
+		// the removal may have moved block's slot
+		where = block_map_get(&mc->where, block, &fresh);
+	}
+	*where = i;
+	mc->blocks[i] = block;
+	shadow_push(mc, i);
+	return 0;
+}
+
+/* 
+ * Classify an access of block, return MISS_NONE if the real cache hit
+ * (hit is 1), the miss class otherwise. Every access updates the shadow.
+ */
+int classify_access(miss_classifier *mc, unsigned long long int block, int hit) {
+	int fresh;
+	block_map_get(&mc->seen, block, &fresh);
+	int shadow_hit = shadow_access(mc, block);
+	if(hit) {
+		return MISS_NONE;
+	}
+	if(fresh) {
+		mc->compulsory++;
+		return MISS_COMPULSORY;
+	}
+	if(!shadow_hit) {
+		mc->capacity_misses++;
+		return MISS_CAPACITY;
+	}
+	mc->conflict++;
+	return MISS_CONFLICT;
+}
+
+/* Free the classifier */
+void free_classifier(miss_classifier *mc) {
+	free(mc->blocks);
+	free(mc->prev);
+	free(mc->next);
+	free_block_map(&mc->seen);
+	free_block_map(&mc->where);
+}
+
+/* Set up the profile of a cache with 2^s sets */
+void init_profile(cache_profile *prof, int s, int b) {
+	size_t sets = (size_t)1 << s;
+	memset(prof->reuse_hist, 0, sizeof(prof->reuse_hist));
+	prof->cold = 0;
+	prof->set_stats = (set_profile*)calloc(sets, sizeof(set_profile));
+	init_stack_distance(&prof->stack, -1, b, PROF_SAMPLE_MAX);
+}
+
+/* Count an eviction of tag in the set's top conflicting tags, space saving style */
+static void count_conflict(set_profile *sp, unsigned long long int tag) {
+	int low = 0;
+	for(int i = 0; i < PROF_TOP_TAGS; i++) {
+		if(sp->hot_counts[i] != 0 && sp->hot_tags[i] == tag) {
+			sp->hot_counts[i]++;
+			return;
+		}
+		if(sp->hot_counts[i] < sp->hot_counts[low]) {
+			low = i;
+		}
+	}
+	// take over the least counted entry, inheriting its count as the error bound
+	sp->hot_tags[low] = tag;
+	sp->hot_counts[low]++;
+}
+
+/* Verbose suffix of each miss class */
+static const char *miss_names[] = {"", " compulsory", " capacity", " conflict"};
+
+/* Function for visiting cache while recording the -P profile and the -3 classes */
+cache_parameter visit_instrumented(cache_parameter para, cache *cur_cache, sim_instruments *ins, 
+		unsigned long long int addr, int size, unsigned long long int cnt, int is_store, int verbo) {
+	cache_profile *prof = ins->prof;
+	set_profile *sp = prof ? &prof->set_stats[get_set(addr, para)] : NULL;
+	unsigned long long int evicted;
+	if(prof != NULL) {
+		// reuse distance as the number of distinct blocks touched since the block's last touch,
+		// each sampled access standing for the accesses of the blocks left out
+		if(sd_sampled(&prof->stack, addr)) {
+			unsigned long long int weight = 1ULL << prof->stack.sample_shift;
+			long long int distance = stack_distance_access(&prof->stack, addr);
+			if(distance < 0) {
+				prof->cold += weight;
+			}else {
+				prof->reuse_hist[distance == 0 ? 0 : 64 - __builtin_clzll(distance)] += weight;
+			}
+		}
+		sp->accesses++;
+	}
+	int result = access_cache(&para, cur_cache, addr, size, cnt, is_store, &evicted);
+	int miss_class = MISS_NONE;
+	if(ins->classes != NULL) {
+		miss_class = classify_access(ins->classes, addr >> para.b, result == ACCESS_HIT);
+	}
+	if(sp != NULL && result != ACCESS_HIT) {
+		sp->misses++;
+		if(result == ACCESS_EVICT) {
+			sp->evictions++;
+			count_conflict(sp, get_tag(evicted, para));
+		}
+	}
+	if(verbo == 1) {
+		printf("%s%s\n", access_names[result], miss_names[miss_class]);
+	}
+	return para;
+}
+
+/* Write the profile as JSON if path ends in .json, as CSV sections otherwise */
+int write_profile(cache_profile *prof, cache_parameter para, const char *path) {
+	FILE *out = fopen(path, "w");
+	size_t sets = (size_t)1 << para.s;
+	size_t len = strlen(path);
+	int json = len >= 5 && strcmp(path + len - 5, ".json") == 0;
+	if(out == NULL) {
+		return -1;
+	}
+	// bucket k holds reuse distances in [2^(k-1), 2^k), counted in distinct blocks
+	// and estimated from 1 in sample blocks once the footprint outgrows PROF_SAMPLE_MAX
+	unsigned long long int sample = 1ULL << prof->stack.sample_shift;
+	if(json) {
+		fprintf(out, "{\n\"s\": %d, \"E\": %d, \"b\": %d, \"cold\": %llu, \"sample\": %llu,\n\"reuse\": [", 
+				para.s, para.E, para.b, prof->cold, sample);
+	}else {
+		fprintf(out, "# reuse distance in distinct blocks, cold %llu, sampled 1 in %llu blocks\nbucket,min_distance,count\n", 
+				prof->cold, sample);
+	}
+	for(int k = 0; k < PROF_BUCKETS; k++) {
+		unsigned long long int lo = k == 0 ? 0 : 1ULL << (k - 1);
+		if(json) {
+			fprintf(out, "%s{\"min_distance\": %llu, \"count\": %llu}", k ? ", " : "", 
+					lo, prof->reuse_hist[k]);
+		}else {
+			fprintf(out, "%d,%llu,%llu\n", k, lo, prof->reuse_hist[k]);
+		}
+	}
+	if(json) {
+		fprintf(out, "],\n\"sets\": [\n");
+	}else {
+		fprintf(out, "\n# sets\nset,accesses,misses,evictions");
+		for(int i = 0; i < PROF_TOP_TAGS; i++) {
+			fprintf(out, ",tag%d,conflicts%d", i, i);
+		}
+		fprintf(out, "\n");
+	}
+	for(size_t i = 0; i < sets; i++) {
+		set_profile *sp = &prof->set_stats[i];
+		if(json) {
+			fprintf(out, "%s{\"set\": %zu, \"accesses\": %llu, \"misses\": %llu, \"evictions\": %llu, \"hot\": [", 
+					i ? ",\n" : "", i, sp->accesses, sp->misses, sp->evictions);
+		}else {
+			fprintf(out, "%zu,%llu,%llu,%llu", i, sp->accesses, sp->misses, sp->evictions);
+		}
+		for(int j = 0; j < PROF_TOP_TAGS; j++) {
+			if(json && sp->hot_counts[j] != 0) {
+				fprintf(out, "%s{\"tag\": \"%llx\", \"conflicts\": %llu}", j ? ", " : "", 
+						sp->hot_tags[j], sp->hot_counts[j]);
+			}else if(!json) {
+				fprintf(out, ",%llx,%llu", sp->hot_tags[j], sp->hot_counts[j]);
+			}
+		}
+		fprintf(out, json ? "]}" : "\n");
+	}
+	if(json) {
+		fprintf(out, "\n]\n}\n");
+	}
+	return fclose(out) == 0 ? 0 : -1;
+}
+
+/* Free the profile */
+void free_profile(cache_profile *prof) {
+	free(prof->set_stats);
+	free_stack_distance(&prof->stack);
+}
+
+/* 
+ * Attach a prefetcher to a cache of geometry para from an
+ * "engine[:degree[:distance[:latency]]]" spec, engine being next,
+ * stride or stream. The stride engine follows strides of up to
+ * 2^RPT_REGION_BITS bytes, 16KB, longer ones never train. Return 0 on
+ * success, -1 on a bad spec.
+ */
+int init_prefetcher(prefetcher *pf, const char *spec, cache_parameter para) {
+	char name[16];
+	int degree = 1, distance = 1, latency = PREFETCH_LATENCY;
+	int n = sscanf(spec, "%15[a-z]:%d:%d:%d", name, &degree, &distance, &latency);
+	if(n < 1 || degree < 1 || distance < 1 || latency < 0) {
+		return -1;
+	}
+	memset(pf, 0, sizeof(*pf));
+	if(strcmp(name, "next") == 0) {
+		pf->engine = PF_NEXT_LINE;
+	}else if(strcmp(name, "stride") == 0) {
+		pf->engine = PF_STRIDE;
+	}else if(strcmp(name, "stream") == 0) {
+		pf->engine = PF_STREAM;
+	}else {
+		return -1;
+	}
+	pf->degree = degree;
+	pf->distance = distance;
+	pf->latency = latency;
+	pf->issued_at = (unsigned long long int*)calloc(((size_t)1 << para.s) * para.E, 
+			sizeof(unsigned long long int));
+	if(pf->issued_at == NULL) {
+		return -1;
+	}
+	for(int i = 0; i < RPT_ENTRIES; i++) {
+		pf->rpt[i].region = ~0ULL;
+	}
+	init_block_map(&pf->victims);
+	return 0;
+}
+
+/* Free the prefetcher */
+void free_prefetcher(prefetcher *pf) {
+	free(pf->issued_at);
+	free_block_map(&pf->victims);
+}
+
+/* Pick the sets of the sample, about one in ratio by a hash of the set index */
+void init_sampling(set_sample *ss, cache_parameter para, int ratio) {
+	ss->ratio = ratio;
+	ss->sets = (size_t)1 << para.s;
+	ss->in = (unsigned char*)calloc(ss->sets, 1);
+	ss->hits = (long*)calloc(ss->sets, sizeof(long));
+	ss->misses = (long*)calloc(ss->sets, sizeof(long));
+	ss->evictions = (long*)calloc(ss->sets, sizeof(long));
+	ss->sampled = 0;
+	for(size_t i = 0; i < ss->sets; i++) {
+		if(block_hash(i) % ratio == 0) {
+			ss->in[i] = 1;
+			ss->sampled++;
+		}
+	}
+	if(ss->sampled == 0) {
+		ss->in[0] = 1;
+		ss->sampled = 1;
+	}
+}
+
+/* Function for one trace record, dropped before any tag work unless its set is sampled */
+cache_parameter visit_sampled(cache_parameter para, cache *cur_cache, set_sample *ss, char op, 
+		unsigned long long int addr, int size, unsigned long long int cnt, int verbo) {
+	size_t set = get_set(addr, para);
+	if(!ss->in[set]) {
+		return para;
+	}
+	long hits = para.hit_count, misses = para.miss_count, evictions = para.eviction_count;
+	para = visit_op(para, cur_cache, op, addr, size, cnt, verbo);
+	ss->hits[set] += para.hit_count - hits;
+	ss->misses[set] += para.miss_count - misses;
+	ss->evictions[set] += para.eviction_count - evictions;
+	return para;
+}
+
+/* Zero the per set counts, after a warmup */
+void reset_sampling(set_sample *ss) {
+	memset(ss->hits, 0, sizeof(long) * ss->sets);
+	memset(ss->misses, 0, sizeof(long) * ss->sets);
+	memset(ss->evictions, 0, sizeof(long) * ss->sets);
+}
+
+/* 
+ * Estimate the total of per set counts x from the sample, return it and
+ * set *half to the half width of its 95% interval. The sets are a
+ * sample without replacement, hence the finite population correction.
+ */
+static double sample_total(set_sample *ss, const long *x, double *half) {
+	double sum = 0, sq = 0;
+	double k = ss->sampled, n = ss->sets;
+	for(size_t i = 0; i < ss->sets; i++) {
+		if(ss->in[i]) {
+			sum += x[i];
+			sq += (double)x[i] * x[i];
+		}
+	}
+	double mean = sum / k;
+	double var = k > 1 ? (sq - k * mean * mean) / (k - 1) : 0;
+	*half = SAMPLE_Z * n * sqrt(var / k * (1 - k / n));
+	return n * mean;
+}
+
+/* 
+ * Print the extrapolated totals with their intervals, and the miss rate
+ * as a ratio estimate. The rounded totals replace the counts of para,
+ * whose write-backs and traffic are scaled up by the same sets ratio.
+ */
+void print_sampling(set_sample *ss, cache_parameter *para) {
+	double h_half, m_half, e_half;
+	double h = sample_total(ss, ss->hits, &h_half);
+	double m = sample_total(ss, ss->misses, &m_half);
+	double e = sample_total(ss, ss->evictions, &e_half);
+	// linearized variance of misses / accesses over the sampled sets
+	double k = ss->sampled, n = ss->sets;
+	double rate = h + m > 0 ? m / (h + m) : 0;
+	double sq = 0, mean_acc = (h + m) / n;
+	for(size_t i = 0; i < ss->sets; i++) {
+		if(ss->in[i]) {
+			double d = ss->misses[i] - rate * (ss->hits[i] + ss->misses[i]);
+			sq += d * d;
+		}
+	}
+	double rate_half = k > 1 && mean_acc > 0 
+			? SAMPLE_Z * sqrt(sq / (k - 1) / k * (1 - k / n)) / mean_acc : 0;
+	printf("sampled-sets:%zu of %zu\n", ss->sampled, ss->sets);
+	printf("estimate hits:%.0f+-%.0f misses:%.0f+-%.0f evictions:%.0f+-%.0f miss-rate:%.6f+-%.6f\n", 
+			h, h_half, m, m_half, e, e_half, rate, rate_half);
+	para->hit_count = (long)(h + 0.5);
+	para->miss_count = (long)(m + 0.5);
+	para->eviction_count = (long)(e + 0.5);
+	para->dirty_eviction_count = (long)(para->dirty_eviction_count * n / k + 0.5);
+	para->bytes_read = (unsigned long long int)(para->bytes_read * n / k + 0.5);
+	para->bytes_written = (unsigned long long int)(para->bytes_written * n / k + 0.5);
+}
+
+/* Free the sample */
+void free_sampling(set_sample *ss) {
+	free(ss->in);
+	free(ss->hits);
+	free(ss->misses);
+	free(ss->evictions);
+}
+
+/* Wall clock in seconds */
+static double wall_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Set up interval reporting every given records and/or seconds */
+void init_intervals(interval_stats *is, unsigned long long int every, double seconds) {
+	memset(is, 0, sizeof(*is));
+	is->every = every;
+	is->seconds = seconds;
+	is->next_time = wall_seconds() + seconds;
+}
+
+/* 
+ * Called after each record with the running totals, print the deltas
+ * since the last report when an interval is over, or when forced at
+ * the end of the trace
+ */
+void interval_tick(interval_stats *is, unsigned long long int records, 
+		long hits, long misses, long evictions, int force) {
+	int due = force && records > is->records;
+	if(is->every != 0 && records - is->records >= is->every) {
+		due = 1;
+	}
+	if(is->seconds > 0 && records % INTERVAL_CLOCK_EVERY == 0 && wall_seconds() >= is->next_time) {
+		is->next_time = wall_seconds() + is->seconds;
+		due = 1;
+	}
+	if(!due) {
+		return;
+	}
+	long d_hits = hits - is->hits;
+	long d_misses = misses - is->misses;
+	printf("interval:%d records:%llu hits:%ld misses:%ld evictions:%ld miss-rate:%.6f\n", 
+			is->n++, records - is->records, d_hits, d_misses, evictions - is->evictions, 
+			d_hits + d_misses ? (double)d_misses / (d_hits + d_misses) : 0.0);
+	fflush(stdout);
+	is->records = records;
+	is->hits = hits;
+	is->misses = misses;
+	is->evictions = evictions;
+}
+
+/* Interval totals of a run, counted like its final summary */
+void report_interval(interval_stats *is, unsigned long long int records, 
+		cache_level *levels, int n_levels, cache_parameter para, int force) {
+	if(n_levels > 1) {
+		long hits = 0, evictions = 0;
+		for(int i = 0; i < n_levels; i++) {
+			hits += levels[i].para.hit_count;
+			evictions += levels[i].para.eviction_count;
+		}
+		interval_tick(is, records, hits, levels[n_levels - 1].para.miss_count, evictions, force);
+	}else {
+		interval_tick(is, records, para.hit_count, para.miss_count, para.eviction_count, force);
+	}
+}
+
+/* Parse a level spec "s:E:b[:policy]" into para, return 0 on success */
+int parse_level(const char *spec, cache_parameter *para) {
+	char name[16];
+	int fields = sscanf(spec, "%d:%d:%d:%15s", &para->s, &para->E, &para->b, name);
+	if(fields < 3) {
+		return -1;
+	}
+	para->policy = fields == 4 ? find_policy(name) : find_policy("lru");
+	if(para->policy == NULL) {
+		return -1;
+	}
+	para->write_back = 1;
+	para->write_allocate = 1;
+	set_index("low", para);
+	reset_counts(para);
+	return 0;
+}
+
+/* 
+ * Select the set index function by name: low, xor, prime or skew.
+ * Return 0 on success, -1 for an unknown name.
+ */
+int set_index(const char *name, cache_parameter *para) {
+	static const char *names[] = {"low", "xor", "prime", "skew"};
+	for(int i = 0; i < 4; i++) {
+		if(strcmp(name, names[i]) == 0) {
+			para->index = i;
+			// largest prime number of sets that fits, 2^s sets otherwise
+			para->index_sets = 1ULL << para->s;
+			while(i == INDEX_PRIME && para->index_sets > 2) {
+				unsigned long long int d = 2;
+				while(d * d <= para->index_sets && para->index_sets % d != 0) {
+					d++;
+				}
+				if(d * d > para->index_sets) {
+					break;
+				}
+				para->index_sets--;
+			}
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* 
+ * Check the geometry suits the replacement policy, return 0 if it does.
+ * Otherwise return -1 with the reason in why, unless why is NULL.
+ */
+int check_policy(cache_parameter para, char *why, size_t len) {
+	if(para.index == INDEX_SKEW && strcmp(para.policy->name, "lru") != 0 
+			&& strcmp(para.policy->name, "fifo") != 0) {
+		if(why != NULL) {
+			snprintf(why, len, "skewed indexing supports lru and fifo");
+		}
+		return -1;
+	}
+	if(para.policy->max_ways != 0 && para.E > para.policy->max_ways) {
+		if(why != NULL) {
+			snprintf(why, len, "%s supports at most %d ways", para.policy->name, para.policy->max_ways);
+		}
+		return -1;
+	}
+	if(para.policy->pow2_ways && (para.E & (para.E - 1)) != 0) {
+		if(why != NULL) {
+			snprintf(why, len, "%s needs a power of two ways", para.policy->name);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/* Find the line to be evicted in set, by using LRU policy */
+int LRU_earliest(cache *cur_cache, size_t set) {
+	return cur_cache->ways->min_way(cur_cache->recency + set * cur_cache->E, cur_cache->E);
+}	
+
+/* Stamp the line with the access time, LRU hit and fill, FIFO fill */
+static void stamp_line(cache *cur_cache, size_t set, int way, unsigned long long int cnt) {
+	cur_cache->recency[set * cur_cache->E + way] = cnt;
+}
+
+/* FIFO hit, order is fixed at fill time */
+static void fifo_hit(cache *cur_cache, size_t set, int way, unsigned long long int cnt) {
+	(void)cur_cache;
+	(void)set;
+	(void)way;
+	(void)cnt;
+}
+
+/* Per set xorshift generator, seeded from the set number so runs repeat */
+static unsigned long long int set_random(cache *cur_cache, size_t set) {
+	unsigned long long int x = cur_cache->set_state[set];
+	if(x == 0) {
+		x = (set + 1) * 0x9e3779b97f4a7c15ULL;
+	}
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	cur_cache->set_state[set] = x;
+	return x;
+}
+
+/* Random victim */
+static int random_victim(cache *cur_cache, size_t set) {
+	return (int)(set_random(cur_cache, set) % cur_cache->E);
+}
+
+/* 
+ * Tree PLRU touch, set_state bit n is internal node n of the tree (root
+ * is 1, children of n are 2n and 2n+1), a set bit points the victim
+ * search to the right subtree. Point every node on the path away from way.
+ */
+static void tree_plru_touch(cache *cur_cache, size_t set, int way, unsigned long long int cnt) {
+	(void)cnt;
+	unsigned long long int bits = cur_cache->set_state[set];
+	int node = 1;
+	for(int half = cur_cache->E >> 1; half > 0; half >>= 1) {
+		int right = (way & half) != 0;
+		if(right) {
+			bits &= ~(1ULL << node);
+		}else {
+			bits |= 1ULL << node;
+		}
+		node = 2 * node + right;
+	}
+	cur_cache->set_state[set] = bits;
+}
+
+/* Tree PLRU victim, follow the node bits down to a leaf */
+static int tree_plru_victim(cache *cur_cache, size_t set) {
+	unsigned long long int bits = cur_cache->set_state[set];
+	int node = 1;
+	int way = 0;
+	for(int half = cur_cache->E >> 1; half > 0; half >>= 1) {
+		int right = (bits >> node) & 1;
+		way |= right ? half : 0;
+		node = 2 * node + right;
+	}
+	return way;
+}
+
+/* Mask with one bit for each way of the set */
+static inline unsigned long long int way_mask(int E) {
+	return E == 64 ? ~0ULL : (1ULL << E) - 1;
+}
+
+/* Bit PLRU touch, set the MRU bit, clear the others once all are set */
+static void bit_plru_touch(cache *cur_cache, size_t set, int way, unsigned long long int cnt) {
+	(void)cnt;
+	unsigned long long int full = way_mask(cur_cache->E);
+	unsigned long long int bits = cur_cache->set_state[set] | (1ULL << way);
+	if(bits == full) {
+		bits = 1ULL << way;
+	}
+	cur_cache->set_state[set] = bits;
+}
+
+/* Bit PLRU victim, first way whose MRU bit is clear */
+static int bit_plru_victim(cache *cur_cache, size_t set) {
+	unsigned long long int clear = ~cur_cache->set_state[set] & way_mask(cur_cache->E);
+	// only a direct mapped set has every bit set after a touch
+	return clear ? __builtin_ctzll(clear) : 0;
+}
+
+/* RRIP hit, predict near re-reference */
+static void rrip_hit(cache *cur_cache, size_t set, int way, unsigned long long int cnt) {
+	(void)cnt;
+	cur_cache->meta[set * cur_cache->E + way] = 0;
+}
+
+/* 
+ * RRIP victim, first way predicted for distant re-reference. Instead of
+ * aging the set one step at a time, age it at once by the distance of
+ * the oldest line to RRPV_MAX.
+ */
+static int rrip_victim(cache *cur_cache, size_t set) {
+	unsigned int *rrpv = cur_cache->meta + set * cur_cache->E;
+	unsigned int oldest = 0;
+	int idx = 0;
+	for(int i = 0; i < cur_cache->E; i++) {
+		if(rrpv[i] > oldest) {
+			oldest = rrpv[i];
+			idx = i;
+			if(oldest == RRPV_MAX) {
+				return idx;
+			}
+		}
+	}
+	for(int i = 0; i < cur_cache->E; i++) {
+		rrpv[i] += RRPV_MAX - oldest;
+	}
+	return idx;
+}
+
+/* SRRIP fill, predict long re-reference */
+static void srrip_fill(cache *cur_cache, size_t set, int way, unsigned long long int cnt) {
+	(void)cnt;
+	cur_cache->meta[set * cur_cache->E + way] = RRPV_MAX - 1;
+}
+
+/* BRRIP fill, predict distant re-reference, long once in a while */
+static void brrip_fill(cache *cur_cache, size_t set, int way, unsigned long long int cnt) {
+	(void)cnt;
+	int lucky = set_random(cur_cache, set) % BRRIP_LONG_ODDS == 0;
+	cur_cache->meta[set * cur_cache->E + way] = lucky ? RRPV_MAX - 1 : RRPV_MAX;
+}
+
+/* 
+ * DRRIP fill, set dueling: misses in the SRRIP leader sets push psel up,
+ * misses in the BRRIP leader sets push it down, and the follower sets
+ * insert like the leader that is missing less.
+ */
+static void drrip_fill(cache *cur_cache, size_t set, int way, unsigned long long int cnt) {
+	size_t slot = set % DUEL_PERIOD;
+	int use_brrip;
+	if(slot == 0) {
+		cur_cache->psel += cur_cache->psel < PSEL_MAX;
+		use_brrip = 0;
+	}else if(slot == DUEL_PERIOD / 2) {
+		cur_cache->psel -= cur_cache->psel > 0;
+		use_brrip = 1;
+	}else {
+		use_brrip = cur_cache->psel > PSEL_MAX / 2;
+	}
+	if(use_brrip) {
+		brrip_fill(cur_cache, set, way, cnt);
+	}else {
+		srrip_fill(cur_cache, set, way, cnt);
+	}
+}
+
+/* LFU hit, count the use and keep the time for breaking ties */
+static void lfu_hit(cache *cur_cache, size_t set, int way, unsigned long long int cnt) {
+	size_t idx = set * cur_cache->E + way;
+	cur_cache->meta[idx] += cur_cache->meta[idx] != ~0u;
+	cur_cache->recency[idx] = cnt;
+}
+
+/* LFU fill */
+static void lfu_fill(cache *cur_cache, size_t set, int way, unsigned long long int cnt) {
+	size_t idx = set * cur_cache->E + way;
+	cur_cache->meta[idx] = 1;
+	cur_cache->recency[idx] = cnt;
+}
+
+/* LFU victim, least used line, least recently used among equals */
+static int lfu_victim(cache *cur_cache, size_t set) {
+	size_t base = set * cur_cache->E;
+	unsigned int *uses = cur_cache->meta + base;
+	unsigned long long int *recency = cur_cache->recency + base;
+	int idx = 0;
+	for(int i = 1; i < cur_cache->E; i++) {
+		if(uses[i] < uses[idx] || (uses[i] == uses[idx] && recency[i] < recency[idx])) {
+			idx = i;
+		}
+	}
+	return idx;
+}
+
+/* All replacement policies, selected by name with -p */
+static const replacement_policy policies[] = {
+	{"lru", 0, 0, stamp_line, stamp_line, LRU_earliest},
+	{"fifo", 0, 0, fifo_hit, stamp_line, LRU_earliest},
+	{"random", 0, 0, fifo_hit, fifo_hit, random_victim},
+	{"plru", 64, 1, tree_plru_touch, tree_plru_touch, tree_plru_victim},
+	{"bitplru", 64, 0, bit_plru_touch, bit_plru_touch, bit_plru_victim},
+	{"srrip", 0, 0, rrip_hit, srrip_fill, rrip_victim},
+	{"brrip", 0, 0, rrip_hit, brrip_fill, rrip_victim},
+	{"drrip", 0, 0, rrip_hit, drrip_fill, rrip_victim},
+	{"lfu", 0, 0, lfu_hit, lfu_fill, lfu_victim},
+};
+
+/* Look up a replacement policy by name, NULL if there is none */
+const replacement_policy *find_policy(const char *name) {
+	for(size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+		if(strcmp(policies[i].name, name) == 0) {
+			return &policies[i];
+		}
+	}
+	return NULL;
+}
+
+/* Scalar tag search, one pass for both the hit and the empty line */
+static int find_way_scalar(const unsigned long long int *tags, const unsigned char *valid, 
+		int E, unsigned long long int tag, int *empty) {
+	*empty = -1;
+	for(int i = 0; i < E; i++) {
+		if(valid[i]) {
+			if(tags[i] == tag) {
+				return i;
+			}
+		}else if(*empty < 0) {
+			*empty = i;
+		}
+	}
+	return -1;
+}
+
+/* Scalar LRU scan */
+static int min_way_scalar(const unsigned long long int *recency, int E) {
+	unsigned long long int min_time = recency[0];
+	int idx = 0;
+	for(int i = 1; i < E; i++) {
+		if(recency[i] < min_time) {
+			min_time = recency[i];
+			idx = i;
+		}
+	}
+	return idx;
+}
+
+#ifdef CSIM_SIMD
+/* 
+ * AVX2 tag search, 32 ways per round: the valid bytes are tested in one
+ * compare and the tags four at a time, giving a hit and an empty bitmap.
+ */
+__attribute__((target("avx2")))
+static int find_way_avx2(const unsigned long long int *tags, const unsigned char *valid, 
+		int E, unsigned long long int tag, int *empty) {
+	__m256i key = _mm256_set1_epi64x((long long)tag);
+	__m256i zero = _mm256_setzero_si256();
+	*empty = -1;
+	for(int i = 0; i < E; i += 32) {
+		unsigned int lim = E - i >= 32 ? ~0u : (1u << (E - i)) - 1;
+		__m256i v = _mm256_loadu_si256((const __m256i*)(valid + i));
+		unsigned int live = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) & lim;
+		unsigned int eq = 0;
+		for(int j = 0; j < 32 && i + j < E; j += 4) {
+			__m256i t = _mm256_loadu_si256((const __m256i*)(tags + i + j));
+			eq |= (unsigned int)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(t, key))) << j;
+		}
+		if(eq & live) {
+			return i + __builtin_ctz(eq & live);
+		}
+		if(*empty < 0 && (~live & lim)) {
+			*empty = i + __builtin_ctz(~live & lim);
+		}
+	}
+	return -1;
+}
+
+/* 
+ * AVX2 LRU scan, min-reduce four lanes at a time then locate the first
+ * way holding the minimum. Access times stay below 2^63, so the signed
+ * compare is exact.
+ */
+__attribute__((target("avx2")))
+static int min_way_avx2(const unsigned long long int *recency, int E) {
+	__m256i best = _mm256_loadu_si256((const __m256i*)recency);
+	int i = 4;
+	for(; i + 4 <= E; i += 4) {
+		__m256i r = _mm256_loadu_si256((const __m256i*)(recency + i));
+		best = _mm256_blendv_epi8(best, r, _mm256_cmpgt_epi64(best, r));
+	}
+	unsigned long long int lane[4];
+	_mm256_storeu_si256((__m256i*)lane, best);
+	unsigned long long int min_time = lane[0];
+	for(int j = 1; j < 4; j++) {
+		min_time = lane[j] < min_time ? lane[j] : min_time;
+	}
+	for(; i < E; i++) {
+		min_time = recency[i] < min_time ? recency[i] : min_time;
+	}
+	__m256i key = _mm256_set1_epi64x((long long)min_time);
+	for(i = 0; ; i += 4) {
+		__m256i r = _mm256_loadu_si256((const __m256i*)(recency + i));
+		int eq = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(r, key)));
+		if(eq) {
+			return i + __builtin_ctz(eq);
+		}
+	}
+}
+
+/* SSE4.2 tag search, same scheme as the AVX2 one with 16 ways per round */
+__attribute__((target("sse4.2")))
+static int find_way_sse42(const unsigned long long int *tags, const unsigned char *valid, 
+		int E, unsigned long long int tag, int *empty) {
+	__m128i key = _mm_set1_epi64x((long long)tag);
+	__m128i zero = _mm_setzero_si128();
+	*empty = -1;
+	for(int i = 0; i < E; i += 16) {
+		unsigned int lim = E - i >= 16 ? 0xffff : (1u << (E - i)) - 1;
+		__m128i v = _mm_loadu_si128((const __m128i*)(valid + i));
+		unsigned int live = ~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & lim;
+		unsigned int eq = 0;
+		for(int j = 0; j < 16 && i + j < E; j += 2) {
+			__m128i t = _mm_loadu_si128((const __m128i*)(tags + i + j));
+			eq |= (unsigned int)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(t, key))) << j;
+		}
+		if(eq & live) {
+			return i + __builtin_ctz(eq & live);
+		}
+		if(*empty < 0 && (~live & lim)) {
+			*empty = i + __builtin_ctz(~live & lim);
+		}
+	}
+	return -1;
+}
+
+/* SSE4.2 LRU scan, two lanes at a time */
+__attribute__((target("sse4.2")))
+static int min_way_sse42(const unsigned long long int *recency, int E) {
+	__m128i best = _mm_loadu_si128((const __m128i*)recency);
+	int i = 2;
+	for(; i + 2 <= E; i += 2) {
+		__m128i r = _mm_loadu_si128((const __m128i*)(recency + i));
+		best = _mm_blendv_epi8(best, r, _mm_cmpgt_epi64(best, r));
+	}
+	unsigned long long int lane[2];
+	_mm_storeu_si128((__m128i*)lane, best);
+	unsigned long long int min_time = lane[0] < lane[1] ? lane[0] : lane[1];
+	for(; i < E; i++) {
+		min_time = recency[i] < min_time ? recency[i] : min_time;
+	}
+	__m128i key = _mm_set1_epi64x((long long)min_time);
+	for(i = 0; ; i += 2) {
+		__m128i r = _mm_loadu_si128((const __m128i*)(recency + i));
+		int eq = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(r, key)));
+		if(eq) {
+			return i + __builtin_ctz(eq);
+		}
+	}
+}
+#endif
+
+/* Way search tables */
+static const way_search scalar_search = {"scalar", find_way_scalar, min_way_scalar};
+#ifdef CSIM_SIMD
+static const way_search avx2_search = {"avx2", find_way_avx2, min_way_avx2};
+static const way_search sse42_search = {"sse4.2", find_way_sse42, min_way_sse42};
+#endif
+
+/* Pick the way search for associativity E, vectors only pay off for wide sets */
+const way_search *pick_way_search(int E) {
+#ifdef CSIM_SIMD
+	if(E < SIMD_MIN_WAYS) {
+		return &scalar_search;
+	}
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		return &avx2_search;
+	}
+	if(__builtin_cpu_supports("sse4.2")) {
+		return &sse42_search;
+	}
+#else
+	(void)E;
+#endif
+	return &scalar_search;
+}
+
+/* Fill the digit table used by the trace scanner */
+void init_digit_table(void) {
+	for(int i = 0; i < 256; i++) {
+		digit_table[i] = 0xff;
+	}
+	for(int i = 0; i < 10; i++) {
+		digit_table['0' + i] = i;
+	}
+	for(int i = 0; i < 6; i++) {
+		digit_table['a' + i] = 10 + i;
+		digit_table['A' + i] = 10 + i;
+	}
+}
+
+/* 
+ * Move the unparsed bytes of a stream to the front of its buffer and
+ * read more after them, until the buffer is full or the stream ends
+ */
+static void refill_trace(trace_reader *reader) {
+	size_t left = reader->end - reader->cur;
+	memmove(reader->buf, reader->cur, left);
+	reader->cur = reader->buf;
+	while(left < STREAM_BUF && !reader->eof) {
+		ssize_t n = read(reader->fd, reader->buf + left, STREAM_BUF - left);
+		if(n <= 0) {
+			reader->eof = 1;
+		}else {
+			left += n;
+		}
+	}
+	reader->end = reader->buf + left;
+}
+
+/* 
+ * Open the trace, return 0 on success. Regular files are mapped whole,
+ * "-" (stdin), pipes and FIFOs are streamed through a buffer, so a
+ * trace can be simulated while its producer is still writing it.
+ * "ring:/name" drains the shared ring of a cachetrace.h producer.
+ */
+int open_trace(trace_reader *reader, const char *path) {
+	struct stat st;
+	reader->map = NULL;
+	reader->fd = -1;
+	reader->buf = NULL;
+	reader->eof = 0;
+	reader->last_addr = 0;
+	reader->binary = 0;
+	reader->ring = NULL;
+	reader->cur = reader->end = NULL;
+	if(strncmp(path, "ring:", 5) == 0) {
+		return open_ring(reader, path + 5);
+	}
+	int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	if(fd < 0) {
+		return -1;
+	}
+	if(fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if(!S_ISREG(st.st_mode)) {
+		reader->fd = fd;
+		reader->buf = (char*)malloc(STREAM_BUF);
+		reader->cur = reader->end = reader->buf;
+		refill_trace(reader);
+		if(reader->end - reader->cur >= TRACE_MAGIC_LEN 
+				&& memcmp(reader->cur, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0) {
+			reader->binary = 1;
+			reader->cur += TRACE_MAGIC_LEN;
+		}
+		return 0;
+	}
+	reader->map_len = st.st_size;
+	if(reader->map_len > 0) {
+		reader->map = mmap(NULL, reader->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(reader->map == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		madvise(reader->map, reader->map_len, MADV_SEQUENTIAL);
+	}
+	// the mapping stays valid after the descriptor is closed
+	close(fd);
+	reader->cur = (const char*)reader->map;
+	reader->end = reader->cur + reader->map_len;
+	// auto detect the binary format by its magic
+	if(reader->map_len >= TRACE_MAGIC_LEN 
+			&& memcmp(reader->cur, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0) {
+		reader->binary = 1;
+		reader->cur += TRACE_MAGIC_LEN;
+	}
+	return 0;
+}
+
+/* 
+ * Cut the piece of rest that falls in its first 2^b byte block into
+ * piece, advancing rest past it. Return 0 once rest is used up. b of 64
+ * or more never splits, so every record is a single piece.
+ */
+int next_piece(trace_record *rest, int b, trace_record *piece) {
+	// a negative size marks rest as used up
+	if(rest->size < 0) {
+		return 0;
+	}
+	*piece = *rest;
+	if(b < 64) {
+		unsigned long long int room = (1ULL << b) - (rest->addr & ((1ULL << b) - 1));
+		if((unsigned long long int)rest->size > room) {
+			piece->size = (int)room;
+			rest->addr += room;
+			rest->size -= (int)room;
+			return 1;
+		}
+	}
+	rest->size = -1;
+	return 1;
+}
+
+/* Get next record of either format, return 1 on success, 0 at end */
+int next_record(trace_reader *reader, trace_record *rec) {
+	if(reader->ring != NULL) {
+		return next_ring_record(reader, rec);
+	}
+	// a stream refills once the buffer may end inside the next record
+	if(reader->fd >= 0 && !reader->eof) {
+		if(!reader->binary) {
+			while(reader->cur < reader->end && (unsigned char)*reader->cur <= ' ') {
+				reader->cur++;
+			}
+		}
+		size_t left = reader->end - reader->cur;
+		if(reader->binary ? left < BINARY_RECORD_MAX : memchr(reader->cur, '\n', left) == NULL) {
+			refill_trace(reader);
+		}
+	}
+	if(reader->binary) {
+		return next_binary_record(reader, rec);
+	}
+	return next_text_record(reader, rec);
+}
+
+/* 
+ * Parse next " op addr,size[,ts]" record, same grammar as the old
+ * fscanf(" %c %llx, %d") loop plus an optional timestamp. Return 1 on success, 0 at end of
+ * trace or on a malformed record.
+ */
+int next_text_record(trace_reader *reader, trace_record *rec) {
+	const unsigned char *p = (const unsigned char*)reader->cur;
+	const unsigned char *end = (const unsigned char*)reader->end;
+	unsigned long long addr = 0;
+	unsigned int d;
+	int size = 0;
+	while(p < end && *p <= ' ') {
+		p++;
+	}
+	if(p == end) {
+		return 0;
+	}
+	rec->op = *p++;
+	while(p < end && *p <= ' ') {
+		p++;
+	}
+	// hex address, table lookup instead of per-range compares
+	if(p + 1 < end && p[0] == '0' && (p[1] | 0x20) == 'x') {
+		p += 2;
+	}
+	const unsigned char *digits = p;
+	while(p < end && (d = digit_table[*p]) < 16) {
+		addr = (addr << 4) | d;
+		p++;
+	}
+	if(p == digits) {
+		return 0;
+	}
+	while(p < end && *p <= ' ') {
+		p++;
+	}
+	if(p == end || *p != ',') {
+		return 0;
+	}
+	p++;
+	while(p < end && *p <= ' ') {
+		p++;
+	}
+	digits = p;
+	while(p < end && (d = *p - '0') < 10) {
+		size = size * 10 + d;
+		p++;
+	}
+	if(p == digits) {
+		return 0;
+	}
+	// optional decimal timestamp for -o ts
+	rec->ts = 0;
+	if(p < end && *p == ',') {
+		p++;
+		while(p < end && (d = *p - '0') < 10) {
+			rec->ts = rec->ts * 10 + d;
+			p++;
+		}
+	}
+	rec->addr = addr;
+	rec->size = size;
+	reader->cur = (const char*)p;
+	return 1;
+}
+
+/* Decode a varint at *pp, return 0 if it runs past end */
+static inline int get_varint(const unsigned char **pp, const unsigned char *end, 
+		unsigned long long *val) {
+	const unsigned char *p = *pp;
+	unsigned long long v = 0;
+	for(int shift = 0; shift < 64 && p < end; shift += 7) {
+		unsigned char byte = *p++;
+		v |= (unsigned long long)(byte & 0x7f) << shift;
+		if(byte < 0x80) {
+			*pp = p;
+			*val = v;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Encode val as a varint into buf, return number of bytes used */
+static inline int put_varint(unsigned char *buf, unsigned long long val) {
+	int n = 0;
+	while(val >= 0x80) {
+		buf[n++] = (unsigned char)(val | 0x80);
+		val >>= 7;
+	}
+	buf[n++] = (unsigned char)val;
+	return n;
+}
+
+/* Decode next binary record, return 1 on success, 0 at end or on truncation */
+int next_binary_record(trace_reader *reader, trace_record *rec) {
+	const unsigned char *p = (const unsigned char*)reader->cur;
+	const unsigned char *end = (const unsigned char*)reader->end;
+	unsigned long long size, delta;
+	if(p == end) {
+		return 0;
+	}
+	unsigned char header = *p++;
+	size = header >> 2;
+	if(size == TRACE_SIZE_ESCAPE && !get_varint(&p, end, &size)) {
+		return 0;
+	}
+	if(!get_varint(&p, end, &delta)) {
+		return 0;
+	}
+	// undo zigzag, small negative deltas were mapped to small odd numbers
+	reader->last_addr += (delta >> 1) ^ (0 - (delta & 1));
+	rec->op = trace_ops[header & 3];
+	rec->size = (int)size;
+	rec->addr = reader->last_addr;
+	rec->ts = 0;
+	reader->cur = (const char*)p;
+	return 1;
+}
+
+/* 
+ * Convert the rest of a trace into the binary format, return number of
+ * records written, or -1 if the output cannot be written. Ops other
+ * than L, S and M are stored as I, the simulator ignores them anyway.
+ */
+long convert_trace(trace_reader *reader, const char *out_path) {
+	FILE *out = fopen(out_path, "wb");
+	if(out == NULL) {
+		return -1;
+	}
+	unsigned char buf[1 << 16];
+	size_t len = 0;
+	long n = 0;
+	unsigned long long last_addr = 0;
+	trace_record rec;
+	memcpy(buf, TRACE_MAGIC, TRACE_MAGIC_LEN);
+	len = TRACE_MAGIC_LEN;
+	while(next_record(reader, &rec)) {
+		// a record is at most 1 + 10 + 10 bytes
+		if(len + 21 > sizeof(buf)) {
+			if(fwrite(buf, 1, len, out) != len) {
+				fclose(out);
+				return -1;
+			}
+			len = 0;
+		}
+		int op = rec.op == 'L' ? 1 : rec.op == 'S' ? 2 : rec.op == 'M' ? 3 : 0;
+		unsigned long long size = (unsigned int)rec.size;
+		long long delta = (long long)(rec.addr - last_addr);
+		if(size < TRACE_SIZE_ESCAPE) {
+			buf[len++] = (unsigned char)(op | (size << 2));
+		}else {
+			buf[len++] = (unsigned char)(op | (TRACE_SIZE_ESCAPE << 2));
+			len += put_varint(buf + len, size);
+		}
+		len += put_varint(buf + len, ((unsigned long long)delta << 1) ^ (unsigned long long)(delta >> 63));
+		last_addr = rec.addr;
+		n++;
+	}
+	if(fwrite(buf, 1, len, out) != len) {
+		n = -1;
+	}
+	if(fclose(out) != 0) {
+		n = -1;
+	}
+	return n;
+}
+
+/* 
+ * Attach to the shared ring name of a cachetrace.h producer, waiting
+ * for the producer to create it as opening a FIFO waits for a writer.
+ * The name is unlinked once mapped, the ring goes away with both sides.
+ * Return 0 on success, -1 if it cannot be mapped.
+ */
+int open_ring(trace_reader *reader, const char *name) {
+	int fd;
+	struct stat st;
+	// the producer sets the magic last, after sizing the ring
+	while(1) {
+		fd = shm_open(name, O_RDWR, 0);
+		if(fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(cachetrace_ring)) {
+			cachetrace_ring *ring = (cachetrace_ring*)mmap(NULL, st.st_size, 
+					PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if(ring != MAP_FAILED) {
+				if(__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) == CACHETRACE_MAGIC) {
+					reader->ring = ring;
+					reader->ring_len = st.st_size;
+					break;
+				}
+				munmap(ring, st.st_size);
+			}
+		}
+		if(fd >= 0) {
+			close(fd);
+		}
+		usleep(1000);
+	}
+	close(fd);
+	shm_unlink(name);
+	if(sizeof(cachetrace_ring) + reader->ring->capacity * sizeof(unsigned long long int) 
+			> reader->ring_len) {
+		close_trace(reader);
+		return -1;
+	}
+	reader->ring_head = reader->ring_tail = 0;
+	return 0;
+}
+
+/* 
+ * Take the next record off the ring, waiting for the producer while it
+ * is empty. Return 0 once the producer closed it and it is drained.
+ */
+int next_ring_record(trace_reader *reader, trace_record *rec) {
+	cachetrace_ring *ring = reader->ring;
+	if(reader->ring_tail == reader->ring_head) {
+		__atomic_store_n(&ring->tail, reader->ring_tail, __ATOMIC_RELEASE);
+		while((reader->ring_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) 
+				== reader->ring_tail) {
+			// closed is set after the last head, so read head once more after seeing it
+			if(__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+				reader->ring_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+				if(reader->ring_head == reader->ring_tail) {
+					return 0;
+				}
+				break;
+			}
+			sched_yield();
+		}
+	}
+	const unsigned long long int *records = (const unsigned long long int*)(ring + 1);
+	unsigned long long int word = records[reader->ring_tail & (ring->capacity - 1)];
+	reader->ring_tail++;
+	if((reader->ring_tail & (CACHETRACE_BATCH - 1)) == 0) {
+		__atomic_store_n(&ring->tail, reader->ring_tail, __ATOMIC_RELEASE);
+	}
+	rec->op = trace_ops[word & 3];
+	rec->size = (int)((word >> 2) & CACHETRACE_SIZE_MAX);
+	rec->addr = word >> 16;
+	rec->ts = 0;
+	return 1;
+}
+
+/* Unmap or close the trace */
+void close_trace(trace_reader *reader) {
+	if(reader->map != NULL) {
+		munmap(reader->map, reader->map_len);
+	}
+	if(reader->ring != NULL) {
+		// a producer still tracing stops instead of waiting on a full ring
+		__atomic_store_n(&reader->ring->closed, 1, __ATOMIC_RELEASE);
+		munmap(reader->ring, reader->ring_len);
+		reader->ring = NULL;
+	}
+	if(reader->fd >= 0) {
+		if(reader->fd != STDIN_FILENO) {
+			close(reader->fd);
+		}
+		free(reader->buf);
+		reader->fd = -1;
+		reader->buf = NULL;
+	}
+	reader->map = NULL;
+	reader->cur = reader->end = NULL;
+}
+
+/* 
+ * Set up the timing model from "hit[,hit...]:memory[:mshrs[:window]]",
+ * one hit latency per cache level. Return 0 on success, -1 on a bad spec.
+ */
+int init_timing(timing_model *tm, const char *spec, int b) {
+	memset(tm, 0, sizeof(*tm));
+	tm->mshrs = TIMING_MSHRS;
+	tm->window = TIMING_WINDOW;
+	tm->b = b;
+	const char *p = spec;
+	char *end;
+	do {
+		if(tm->n_levels == MAX_LEVELS) {
+			return -1;
+		}
+		tm->hit_latency[tm->n_levels++] = (int)strtol(p, &end, 10);
+		if(end == p) {
+			return -1;
+		}
+		p = end + 1;
+	}while(*end == ',');
+	if(*end != ':' || sscanf(p, "%d:%d:%d", &tm->memory_latency, &tm->mshrs, &tm->window) < 1 
+			|| tm->mshrs < 1 || tm->window < 1) {
+		return -1;
+	}
+	tm->mshr_block = (unsigned long long int*)calloc(tm->mshrs, sizeof(unsigned long long int));
+	tm->mshr_done = (unsigned long long int*)calloc(tm->mshrs, sizeof(unsigned long long int));
+	tm->retire = (unsigned long long int*)calloc(tm->window, sizeof(unsigned long long int));
+	return 0;
+}
+
+/* Cycles of a load served by level served, n_levels for memory */
+static unsigned long long int served_latency(timing_model *tm, int served) {
+	unsigned long long int latency = 0;
+	for(int i = 0; i <= served && i < tm->n_levels; i++) {
+		latency += tm->hit_latency[i];
+	}
+	if(served >= tm->n_levels) {
+		latency += tm->memory_latency;
+	}
+	return latency;
+}
+
+/* 
+ * Time one record whose first access was served by level served, n_levels
+ * for memory, after translation cycles of address translation. Stores
+ * retire into a store buffer without waiting for data.
+ */
+void time_access(timing_model *tm, unsigned long long int addr, int served, int is_store, 
+		unsigned long long int translation) {
+	unsigned long long int now = tm->now;
+	// the record window records back must have retired
+	unsigned long long int oldest = tm->retire[tm->records % tm->window];
+	if(oldest > now) {
+		tm->window_stalls += oldest - now;
+		now = oldest;
+	}
+	unsigned long long int latency = translation + served_latency(tm, served);
+	unsigned long long int block = addr >> tm->b;
+	int in_flight = -1, earliest = 0;
+	for(int i = 0; i < tm->mshrs; i++) {
+		if(tm->mshr_done[i] > now && tm->mshr_block[i] == block) {
+			in_flight = i;
+		}
+		if(tm->mshr_done[i] < tm->mshr_done[earliest]) {
+			earliest = i;
+		}
+	}
+	if(in_flight >= 0) {
+		// the cache model filled it at once, the data is still on its way
+		if(tm->mshr_done[in_flight] - now > latency) {
+			latency = tm->mshr_done[in_flight] - now;
+		}
+	}else if(served > 0) {
+		if(tm->mshr_done[earliest] > now) {
+			tm->mshr_stalls += tm->mshr_done[earliest] - now;
+			now = tm->mshr_done[earliest];
+		}
+		tm->mshr_block[earliest] = block;
+		tm->mshr_done[earliest] = now + latency;
+	}
+	tm->latency_sum += latency;
+	unsigned long long int retire = is_store ? now + 1 + translation : now + latency;
+	if(retire < tm->last_retire) {
+		retire = tm->last_retire;
+	}
+	tm->last_retire = retire;
+	tm->retire[tm->records % tm->window] = retire;
+	tm->records++;
+	tm->now = now + 1;
+}
+
+/* Start counting over, after a warmup */
+void reset_timing(timing_model *tm) {
+	tm->start = tm->now;
+	tm->records = 0;
+	tm->latency_sum = 0;
+	tm->mshr_stalls = 0;
+	tm->window_stalls = 0;
+}
+
+/* Print total and stall cycles, issue takes one cycle per record and the rest is stalls */
+void print_timing(timing_model *tm) {
+	unsigned long long int end = tm->last_retire > tm->now ? tm->last_retire : tm->now;
+	unsigned long long int cycles = end - tm->start;
+	printf("cycles:%llu stall-cycles:%llu amat:%.2f mshr-stall-cycles:%llu window-stall-cycles:%llu\n", 
+			cycles, cycles > tm->records ? cycles - tm->records : 0, 
+			tm->records ? (double)tm->latency_sum / tm->records : 0.0, 
+			tm->mshr_stalls, tm->window_stalls);
+}
+
+/* Free the model */
+void free_timing(timing_model *tm) {
+	free(tm->mshr_block);
+	free(tm->mshr_done);
+	free(tm->retire);
+}
+
+/* Offset bits of each page size */
+static const int page_shift[PAGE_SIZES] = {12, 21, 30};
+static const char *page_names[PAGE_SIZES] = {"4k", "2m", "1g"};
+
+/* Empty TLB model, every page 4KB */
+void init_tlb(tlb_model *tlb) {
+	memset(tlb, 0, sizeof(*tlb));
+	tlb->default_size = PAGE_4K;
+}
+
+/* 
+ * Add a level below the others from "entries:ways[:latency]", entries
+ * over ways a power of two. Return 0 on success, -1 on a bad spec.
+ */
+int add_tlb_level(tlb_model *tlb, const char *spec) {
+	int entries, ways, latency = 0;
+	if(tlb->n_levels == MAX_TLB_LEVELS 
+			|| sscanf(spec, "%d:%d:%d", &entries, &ways, &latency) < 2 
+			|| ways < 1 || entries < ways || entries % ways != 0 || latency < 0) {
+		return -1;
+	}
+	int sets = entries / ways;
+	if((sets & (sets - 1)) != 0) {
+		return -1;
+	}
+	cache_parameter *para = &tlb->levels[tlb->n_levels].para;
+	para->s = 0;
+	while((1 << para->s) < sets) {
+		para->s++;
+	}
+	para->E = ways;
+	para->b = 0;
+	para->policy = find_policy("lru");
+	para->write_back = 1;
+	para->write_allocate = 1;
+	set_index("low", para);
+	reset_counts(para);
+	tlb->latency[tlb->n_levels++] = latency;
+	return 0;
+}
+
+/* Page size named 4k, 2m or 1g, -1 for another name */
+static int page_size_of(const char *name, size_t len) {
+	for(int i = 0; i < PAGE_SIZES; i++) {
+		if(strlen(page_names[i]) == len && strncmp(name, page_names[i], len) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* 
+ * Set the page map from "size[,size@lo-hi...]", a default page size and
+ * ranges of hex addresses mapped with another, the first match wins.
+ * Return 0 on success, -1 on a bad spec.
+ */
+int set_page_map(tlb_model *tlb, const char *spec) {
+	const char *p = spec;
+	tlb->n_ranges = 0;
+	while(*p != '\0') {
+		size_t len = strcspn(p, "@,");
+		int size = page_size_of(p, len);
+		if(size < 0) {
+			return -1;
+		}
+		p += len;
+		if(*p == '@') {
+			char *end;
+			page_range *r = &tlb->ranges[tlb->n_ranges];
+			if(tlb->n_ranges == MAX_PAGE_RANGES) {
+				return -1;
+			}
+			r->lo = strtoull(p + 1, &end, 16);
+			if(*end != '-') {
+				return -1;
+			}
+			r->hi = strtoull(end + 1, &end, 16);
+			if(r->hi <= r->lo || (*end != ',' && *end != '\0')) {
+				return -1;
+			}
+			r->size = size;
+			tlb->n_ranges++;
+			p = end;
+		}else {
+			tlb->default_size = size;
+		}
+		if(*p == ',') {
+			p++;
+		}
+	}
+	return 0;
+}
+
+/* Allocate the levels once their geometry is set */
+void alloc_tlb(tlb_model *tlb) {
+	for(int i = 0; i < tlb->n_levels; i++) {
+		tlb->levels[i].c = init_cache(tlb->levels[i].para);
+		tlb->levels[i].back_invalidations = 0;
+	}
+}
+
+/* 
+ * Address of the page table entry step of a walk loads for addr, step 0
+ * in the root table. Every table of a step sits next to the others, so
+ * the entries of neighbouring pages share cache lines as in a real table.
+ */
+static inline unsigned long long int walk_entry(unsigned long long int addr, int step) {
+	addr &= (1ULL << 48) - 1;  // 48 bit virtual addresses
+	return WALK_BASE | (unsigned long long int)step << 52 | (addr >> (39 - 9 * step)) << 3;
+}
+
+/* 
+ * Translate addr. On a miss in every TLB level walk the page table, the
+ * walk's loads going through the single cache c with its parameters
+ * para, or through the hierarchy levels when n is over 1. Return the
+ * cycles the translation took under tm, 0 without one.
+ */
+unsigned long long int translate(tlb_model *tlb, unsigned long long int addr, 
+		unsigned long long int cnt, cache_parameter *para, cache *c, 
+		cache_level *levels, int n, int inclusion, timing_model *tm, int verbo) {
+	int size = tlb->default_size;
+	for(int i = 0; i < tlb->n_ranges; i++) {
+		if(addr >= tlb->ranges[i].lo && addr < tlb->ranges[i].hi) {
+			size = tlb->ranges[i].size;
+			break;
+		}
+	}
+	// the page size in the top bits keeps pages of different sizes apart
+	unsigned long long int page = addr >> page_shift[size] | (unsigned long long int)size << 60;
+	int hit_level = visit_hierarchy(tlb->levels, tlb->n_levels, INCL_NINE, page, cnt, 0);
+	unsigned long long int cycles = 0;
+	for(int i = 0; i <= hit_level && i < tlb->n_levels; i++) {
+		cycles += tlb->latency[i];
+	}
+	tlb->translations[size]++;
+	tlb->misses[size] += hit_level > 0;
+	if(hit_level == tlb->n_levels) {
+		// 4KB pages walk 4 levels, each larger size stops one level sooner
+		int steps = 4 - size;
+		tlb->walks[size]++;
+		tlb->walk_refs[size] += steps;
+		if(verbo == 1) {
+			printf("TLB miss ");
+		}
+		for(int step = 0; step < steps; step++) {
+			unsigned long long int entry = walk_entry(addr, step);
+			int served;
+			if(n > 1) {
+				served = visit_hierarchy(levels, n, inclusion, entry, cnt, 0);
+			}else {
+				long misses = para->miss_count;
+				*para = visit_cache(*para, c, entry, cnt, 0);
+				served = para->miss_count > misses;
+			}
+			tlb->walk_memory_refs[size] += served == n;
+			if(tm != NULL) {
+				// each step needs the entry the one before it loaded
+				cycles += served_latency(tm, served);
+			}
+		}
+	}
+	if(tm == NULL) {
+		return 0;
+	}
+	tlb->cycles[size] += cycles;
+	return cycles;
+}
 
-	long hit_count; // number of hits
-	long miss_count; // number of misses
-	long eviction_count; // number of evictions 
-} cache_parameter;
+/* Zero the counts of the model, after a warmup */
+void reset_tlb(tlb_model *tlb) {
+	for(int i = 0; i < tlb->n_levels; i++) {
+		reset_counts(&tlb->levels[i].para);
+	}
+	memset(tlb->translations, 0, sizeof(tlb->translations));
+	memset(tlb->misses, 0, sizeof(tlb->misses));
+	memset(tlb->walks, 0, sizeof(tlb->walks));
+	memset(tlb->walk_refs, 0, sizeof(tlb->walk_refs));
+	memset(tlb->walk_memory_refs, 0, sizeof(tlb->walk_memory_refs));
+	memset(tlb->cycles, 0, sizeof(tlb->cycles));
+}
 
-/* Struct for lines in set */
-typedef struct {
-	int valid;  // valid bit
-	long tag;  // tag
-	unsigned long long int address; // addr, 64 bit hex
-	int* block;  // block
-	int access_time;  // last access time
-} cache_line;
+/* Print each level's counts, then the translations and walks of each page size in use */
+void print_tlb(tlb_model *tlb, int timed) {
+	for(int i = 0; i < tlb->n_levels; i++) {
+		cache_parameter *lp = &tlb->levels[i].para;
+		printf("TLB%d hits:%ld misses:%ld evictions:%ld\n", i + 1, 
+				lp->hit_count, lp->miss_count, lp->eviction_count);
+	}
+	for(int i = 0; i < PAGE_SIZES; i++) {
+		if(tlb->translations[i] == 0 && i != tlb->default_size) {
+			continue;
+		}
+		printf("pages-%s translations:%ld tlb-misses:%ld walks:%ld walk-refs:%ld walk-memory-refs:%ld", 
+				page_names[i], tlb->translations[i], tlb->misses[i], tlb->walks[i], 
+				tlb->walk_refs[i], tlb->walk_memory_refs[i]);
+		if(timed) {
+			printf(" translation-cycles:%llu", tlb->cycles[i]);
+		}
+		printf("\n");
+	}
+}
 
-/* Struct for set */
-typedef struct {
-	cache_line* lines;
-} cache_set;
+/* Free the levels */
+void free_tlb(tlb_model *tlb) {
+	for(int i = 0; i < tlb->n_levels; i++) {
+		free_cache(tlb->levels[i].c, tlb->levels[i].para);
+	}
+}
 
-/* Struct for cache */
-typedef struct {
-	cache_set* sets;
-} cache;
+/* Round len up to a whole number of pages */
+static unsigned long long int page_up(unsigned long long int len) {
+	unsigned long long int page = sysconf(_SC_PAGESIZE);
+	return (len + page - 1) / page * page;
+}
 
-cache init_cache(cache_parameter input_para);
-int get_set(unsigned long long int addr, cache_parameter para);
-long get_tag(unsigned long long int addr, cache_parameter para);
-void free_cache(cache cache_cur, cache_parameter para);
-cache_parameter visit_cache(cache_parameter para, cache *cur_cache, 
-		unsigned long long int addr, int cnt, int verbo);
-int LRU_earliest(cache_parameter para, cache_set *cur_set);
+/* 
+ * Save the state of an n level run, its caches, counts and place in the
+ * mapped trace, to path. It is written aside and renamed over path, so
+ * a run killed while writing leaves the previous checkpoint intact.
+ * Return 0 on success, -1 on failure.
+ */
+int write_checkpoint(const char *path, cache_level *levels, int n, int inclusion, 
+		trace_reader *reader, unsigned long long int cnt) {
+	checkpoint_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+	h.n_levels = n;
+	h.inclusion = inclusion;
+	h.cnt = cnt;
+	h.trace_len = reader->map_len;
+	h.trace_offset = reader->cur - (const char*)reader->map;
+	h.last_addr = reader->last_addr;
+	unsigned long long int offset = page_up(sizeof(h));
+	for(int i = 0; i < n; i++) {
+		checkpoint_level *cl = &h.level[i];
+		cache_parameter *lp = &levels[i].para;
+		cl->s = lp->s;
+		cl->E = lp->E;
+		cl->b = lp->b;
+		strncpy(cl->policy, lp->policy->name, sizeof(cl->policy) - 1);
+		cl->write_back = lp->write_back;
+		cl->write_allocate = lp->write_allocate;
+		cl->psel = levels[i].c.psel;
+		cl->index = lp->index;
+		cl->hit_count = lp->hit_count;
+		cl->miss_count = lp->miss_count;
+		cl->eviction_count = lp->eviction_count;
+		cl->dirty_eviction_count = lp->dirty_eviction_count;
+		cl->bytes_read = lp->bytes_read;
+		cl->bytes_written = lp->bytes_written;
+		cl->back_invalidations = levels[i].back_invalidations;
+		cl->mem_len = levels[i].c.mem_len;
+		cl->mem_offset = offset;
+		offset += page_up(cl->mem_len);
+	}
+	char *tmp = (char*)malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	FILE *out = fopen(tmp, "wb");
+	int ok = out != NULL && fwrite(&h, sizeof(h), 1, out) == 1;
+	for(int i = 0; ok && i < n; i++) {
+		ok = fseek(out, (long)h.level[i].mem_offset, SEEK_SET) == 0 
+				&& fwrite(levels[i].c.mem, 1, levels[i].c.mem_len, out) == levels[i].c.mem_len;
+	}
+	if(out != NULL && fclose(out) != 0) {
+		ok = 0;
+	}
+	ok = ok && rename(tmp, path) == 0;
+	if(!ok) {
+		unlink(tmp);
+	}
+	free(tmp);
+	return ok ? 0 : -1;
+}
 
-/* Function that initilize cache */
-cache init_cache(cache_parameter input_para) {
-	int S = 1 << input_para.s;
-	int B = 1 << input_para.b;
-	int E = input_para.E;
-	cache new_cache;
-	new_cache.sets = (cache_set*)malloc(sizeof(cache_set) * S);
-	for(int i = 0; i < S; i++) {
-		cache_set set_cur;
-		set_cur.lines = (cache_line*)malloc(sizeof(cache_line) * E);
-		new_cache.sets[i] = set_cur;
-		for(int j = 0; j < E; j++) {
-			cache_line line_cur;
-			line_cur.block = (int*)malloc(sizeof(int) * B);
-			line_cur.valid = 0;
-			line_cur.tag = 0;
-			line_cur.access_time = 0;
-			line_cur.address = 0;
-			new_cache.sets[i].lines[j] = line_cur;
+/* 
+ * Restore a run saved by write_checkpoint into levels, whose parameters
+ * must match the saved ones, and move the reader to where it stopped.
+ * Each cache's arrays are mapped copy-on-write from the file instead of
+ * read, so the load costs a few page faults, not a pass over the
+ * state. Return 0 on success, -1 with a message on failure.
+ */
+int load_checkpoint(const char *path, cache_level *levels, int n, int inclusion, 
+		trace_reader *reader, unsigned long long int *cnt) {
+	checkpoint_header h;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0 || read(fd, &h, sizeof(h)) != (ssize_t)sizeof(h) 
+			|| memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0) {
+		printf("checkpoint %s cannot be read.\n", path);
+		if(fd >= 0) {
+			close(fd);
 		}
+		return -1;
 	}
-	return new_cache;
+	int match = h.n_levels == n && h.inclusion == inclusion && h.trace_len == reader->map_len 
+			&& h.trace_offset <= h.trace_len;
+	for(int i = 0; match && i < n; i++) {
+		checkpoint_level *cl = &h.level[i];
+		cache_parameter *lp = &levels[i].para;
+		match = cl->s == lp->s && cl->E == lp->E && cl->b == lp->b 
+				&& strncmp(cl->policy, lp->policy->name, sizeof(cl->policy)) == 0 
+				&& cl->write_back == lp->write_back && cl->write_allocate == lp->write_allocate 
+				&& cl->index == lp->index && cl->mem_len == lay_out_cache(NULL, *lp, NULL);
+	}
+	if(!match) {
+		printf("checkpoint %s does not match this run.\n", path);
+		close(fd);
+		return -1;
+	}
+	for(int i = 0; i < n; i++) {
+		checkpoint_level *cl = &h.level[i];
+		cache_parameter *lp = &levels[i].para;
+		void *mem = mmap(NULL, cl->mem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, cl->mem_offset);
+		if(mem == MAP_FAILED) {
+			printf("checkpoint %s cannot be mapped.\n", path);
+			close(fd);
+			return -1;
+		}
+		free_cache(levels[i].c, *lp);
+		levels[i].c = map_cache(*lp, mem, cl->mem_len);
+		levels[i].c.psel = cl->psel;
+		lp->hit_count = cl->hit_count;
+		lp->miss_count = cl->miss_count;
+		lp->eviction_count = cl->eviction_count;
+		lp->dirty_eviction_count = cl->dirty_eviction_count;
+		lp->bytes_read = cl->bytes_read;
+		lp->bytes_written = cl->bytes_written;
+		levels[i].back_invalidations = cl->back_invalidations;
+	}
+	close(fd);
+	reader->cur = (const char*)reader->map + h.trace_offset;
+	reader->last_addr = h.last_addr;
+	*cnt = h.cnt;
+	return 0;
 }
 
-/* Get set number from address */
-int get_set(unsigned long long int addr, cache_parameter para) {
-	unsigned int mask = (1 << para.s) - 1;
-	return (addr >> para.b) & mask;
+/* 
+ * Library entry points, see CachePlay.h. They go through access_cache
+ * on the handle's own counts, so nothing is copied per access.
+ */
+csim *csim_create(const csim_config *config) {
+	cache_parameter para;
+	para.s = config->s;
+	para.E = config->E;
+	para.b = config->b;
+	para.policy = find_policy(config->policy != NULL ? config->policy : "lru");
+	para.write_back = !config->write_through;
+	para.write_allocate = !config->no_write_allocate;
+	reset_counts(&para);
+	if(para.s < 0 || para.E < 1 || para.b < 0 || para.s + para.b >= 64 || para.policy == NULL 
+			|| set_index(config->index != NULL ? config->index : "low", &para) != 0 
+			|| check_policy(para, NULL, 0) != 0) {
+		return NULL;
+	}
+	if(para.index == INDEX_SKEW && config->prefetch != NULL) {
+		// a block has no single set to prefetch into, as main refuses -H skew with -F
+		return NULL;
+	}
+	csim *sim = (csim*)malloc(sizeof(csim));
+	if(sim == NULL) {
+		return NULL;
+	}
+	sim->para = para;
+	if(alloc_cache(&sim->c, para) != 0) {
+		free(sim);
+		return NULL;
+	}
+	if(config->prefetch != NULL) {
+		if(init_prefetcher(&sim->pf, config->prefetch, para) != 0) {
+			free_cache(sim->c, para);
+			free(sim);
+			return NULL;
+		}
+		sim->c.pf = &sim->pf;
+	}
+	sim->span_bits = config->split_blocks ? para.b : 64;
+	sim->cnt = 1;
+	return sim;
 }
 
-/* Get tag from address */
-long get_tag(unsigned long long int addr, cache_parameter para) { 
-	return addr >> (para.s + para.b);
+/* One access of the library, shared by the single and batched calls */
+static inline int csim_visit(csim *sim, unsigned long long int addr, int size, char op) {
+	trace_record rest, piece;
+	unsigned long long int evicted;
+	int first = -1;
+	if(op != 'L' && op != 'S' && op != 'M') {
+		return -1;
+	}
+	rest.op = op;
+	rest.size = size;
+	rest.addr = addr;
+	rest.ts = 0;
+	while(next_piece(&rest, sim->span_bits, &piece)) {
+		int result = ACCESS_HIT;
+		if(op == 'L' || op == 'M') {
+			result = access_cache(&sim->para, &sim->c, piece.addr, piece.size, sim->cnt, 0, &evicted);
+		}
+		if(op == 'S' || op == 'M') {
+			int stored = access_cache(&sim->para, &sim->c, piece.addr, piece.size, sim->cnt, 1, &evicted);
+			if(op == 'S') {
+				result = stored;
+			}
+		}
+		if(first < 0) {
+			first = result;
+		}
+	}
+	sim->cnt++;
+	return first;
 }
 
-/* Free the cache */
-void free_cache(cache cache_cur, cache_parameter para) {
-	int S = 1 << para.s;
-	for(int i = 0; i < S; i++) {
-		for(int j = 0; j < para.E; j++) {
-			if(cache_cur.sets[i].lines[j].block != NULL) {
-				free(cache_cur.sets[i].lines[j].block);
+int csim_access(csim *sim, unsigned long long int addr, int size, char op) {
+	return csim_visit(sim, addr, size, op);
+}
+
+void csim_access_batch(csim *sim, const csim_record *records, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		csim_visit(sim, records[i].addr, records[i].size, records[i].op);
+	}
+}
+
+void csim_stats(const csim *sim, csim_counts *counts) {
+	counts->hits = sim->para.hit_count;
+	counts->misses = sim->para.miss_count;
+	counts->evictions = sim->para.eviction_count;
+	counts->dirty_evictions = sim->para.dirty_eviction_count;
+	counts->bytes_read = sim->para.bytes_read;
+	counts->bytes_written = sim->para.bytes_written;
+	counts->prefetches = sim->c.pf != NULL ? sim->pf.issued : 0;
+	counts->useful_prefetches = sim->c.pf != NULL ? sim->pf.useful + sim->pf.late : 0;
+}
+
+void csim_destroy(csim *sim) {
+	if(sim == NULL) {
+		return;
+	}
+	if(sim->c.pf != NULL) {
+		free_prefetcher(&sim->pf);
+	}
+	free_cache(sim->c, sim->para);
+	free(sim);
+}
+
+/* 
+ * Decode the rest of a trace into one array of records, skipping
+ * instruction fetches. Return the array and its length in *n.
+ */
+csim_record *decode_trace(trace_reader *reader, size_t *n) {
+	size_t cap = 1 << 16;
+	csim_record *records = (csim_record*)malloc(sizeof(csim_record) * cap);
+	trace_record rec;
+	*n = 0;
+	while(next_record(reader, &rec)) {
+		if(rec.op != 'L' && rec.op != 'S' && rec.op != 'M') {
+			continue;
+		}
+		if(*n == cap) {
+			cap *= 2;
+			records = (csim_record*)realloc(records, sizeof(csim_record) * cap);
+		}
+		records[*n].addr = rec.addr;
+		records[*n].size = rec.size;
+		records[*n].op = rec.op;
+		(*n)++;
+	}
+	return records;
+}
+
+/* Parse "4,6-8" into values, return their number or -1 */
+static int parse_values(char *list, int *values) {
+	int n = 0;
+	for(char *tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		int lo, hi;
+		int got = sscanf(tok, "%d-%d", &lo, &hi);
+		if(got < 1) {
+			return -1;
+		}
+		if(got == 1) {
+			hi = lo;
+		}
+		for(int v = lo; v <= hi; v++) {
+			if(n == SWEEP_MAX_VALUES) {
+				return -1;
+			}
+			values[n++] = v;
+		}
+	}
+	return n;
+}
+
+/* 
+ * Expand a grid "s=4-8/E=1,2,4/b=6/p=lru,srrip" into the product of its
+ * dimensions, missing ones keep the value of base. Policy names are
+ * checked and point at the policy table, so the points own no strings.
+ * Return the number of points, or -1 on a bad grid.
+ */
+int parse_sweep(const char *grid, csim_config base, sweep_point **points) {
+	int values[3][SWEEP_MAX_VALUES] = {{base.s}, {base.E}, {base.b}};
+	int n_values[3] = {1, 1, 1};
+	const char *policies[SWEEP_MAX_VALUES] = {base.policy};
+	int n_policies = 1;
+	char *copy = strdup(grid);
+	char *save = NULL;
+	for(char *dim = strtok_r(copy, "/", &save); dim != NULL; dim = strtok_r(NULL, "/", &save)) {
+		char *eq = strchr(dim, '=');
+		if(eq == NULL || eq - dim != 1) {
+			free(copy);
+			return -1;
+		}
+		const char *keys = "sEb";
+		const char *key = strchr(keys, dim[0]);
+		if(dim[0] == 'p') {
+			n_policies = 0;
+			char *psave = NULL;
+			for(char *name = strtok_r(eq + 1, ",", &psave); name != NULL; 
+					name = strtok_r(NULL, ",", &psave)) {
+				const replacement_policy *policy = find_policy(name);
+				if(n_policies == SWEEP_MAX_VALUES || policy == NULL) {
+					free(copy);
+					return -1;
+				}
+				policies[n_policies++] = policy->name;
+			}
+		}else if(key != NULL) {
+			n_values[key - keys] = parse_values(eq + 1, values[key - keys]);
+			if(n_values[key - keys] <= 0) {
+				free(copy);
+				return -1;
 			}
+		}else {
+			free(copy);
+			return -1;
 		}
-		if(cache_cur.sets[i].lines != NULL) {	
-			free(cache_cur.sets[i].lines);
-		}	
 	}
-	if(cache_cur.sets != NULL) {
-		free(cache_cur.sets);
+	free(copy);
+	long total = (long)n_values[0] * n_values[1] * n_values[2] * n_policies;
+	if(total == 0 || total > SWEEP_MAX_POINTS) {
+		return -1;
 	}
+	*points = (sweep_point*)calloc(total, sizeof(sweep_point));
+	int k = 0;
+	for(int i = 0; i < n_values[0]; i++) {
+		for(int j = 0; j < n_values[1]; j++) {
+			for(int l = 0; l < n_values[2]; l++) {
+				for(int q = 0; q < n_policies; q++) {
+					sweep_point *pt = &(*points)[k++];
+					pt->config = base;
+					pt->config.s = values[0][i];
+					pt->config.E = values[1][j];
+					pt->config.b = values[2][l];
+					pt->config.policy = policies[q];
+				}
+			}
+		}
+	}
+	return k;
 }
 
-/* Function for visiting cache, and update count number for output */
-cache_parameter visit_cache(cache_parameter para, cache *cur_cache, 
-			unsigned long long int addr, int cnt, int verbo) {
-	int set_num = get_set(addr, para);
-	long tag_num = get_tag(addr, para);
-	cache_set *cur_set = &cur_cache->sets[set_num];
-	// seach in current set
-	for(int i = 0; i < para.E; i++)	{
-		cache_line *cur_line = &cur_set->lines[i];
-		if(cur_line->valid == 1 && cur_line->tag == tag_num) {
-			para.hit_count++;
-			cur_line->access_time = cnt;
-			if(verbo == 1) {
-				printf("hit\n");
-			}
-			cur_line = NULL;
-			free(cur_line);
-			return para;
-		}
-	}
-	// not hit
-	para.miss_count++;
-	// search empty line, no eviction
-	for(int i = 0; i < para.E; i++) {
-		cache_line *cur_line = &cur_set->lines[i];
-		if(cur_line->valid == 0) {
-			cur_line->valid = 1;
-			cur_line->tag = tag_num;
-			cur_line->access_time = cnt;
-			if(verbo == 1) {
-				printf("miss\n");
-			}
-			cur_line = NULL;
-			free(cur_line);	
-			return para;
-		}
-	}
-	// need eviction
-	if(verbo == 1) {
-		printf("miss eviction\n");
-	}
-	para.eviction_count++;
-	int evict_idx = LRU_earliest(para, cur_set);
-	cache_line *cur_line = &cur_set->lines[evict_idx];
-	cur_line->valid = 1;
-	cur_line->tag = tag_num;
-	cur_line->access_time = cnt;
-	cur_line = NULL;
-	free(cur_line);	
-	cur_set = NULL;
-	free(cur_set);
-	return para;	
+/* Next point for worker id, its own most expensive first, else the other workers' cheapest */
+static int sweep_take(sweep_pool *pool, int id) {
+	for(int k = 0; k < pool->n_workers; k++) {
+		sweep_deque *dq = &pool->deques[(id + k) % pool->n_workers];
+		int item = -1;
+		pthread_mutex_lock(&dq->lock);
+		if(dq->top < dq->bottom) {
+			item = k == 0 ? dq->items[dq->top++] : dq->items[--dq->bottom];
+		}
+		pthread_mutex_unlock(&dq->lock);
+		if(item >= 0) {
+			return item;
+		}
+	}
+	return -1;
 }
-	
-/* Find the line to be evicted, by using LRU policy */
-int LRU_earliest(cache_parameter para, cache_set *cur_set) {
-	int min_time = cur_set->lines[0].access_time;
-	int idx = 0;
-	for(int i = 1; i < para.E; i++) {
-		if(cur_set->lines[i].access_time < min_time) {
-			min_time = cur_set->lines[i].access_time;
-			idx = i;
+
+/* Worker thread, runs points until every deque is empty */
+static void *sweep_main(void *arg) {
+	sweep_worker *w = (sweep_worker*)arg;
+	sweep_pool *pool = w->pool;
+	int item;
+	while((item = sweep_take(pool, w->id)) >= 0) {
+		sweep_point *pt = &pool->points[item];
+		csim *sim = csim_create(&pt->config);
+		if(sim == NULL) {
+			continue;
+		}
+		for(size_t i = 0; i < pool->n_records; i++) {
+			csim_visit(sim, pool->records[i].addr, pool->records[i].size, pool->records[i].op);
 		}
+		csim_stats(sim, &pt->counts);
+		pt->ok = 1;
+		csim_destroy(sim);
 	}
-	return idx;
-}	
+	return NULL;
+}
+
+/* Estimated run time of a point, ways are searched on every access */
+static int sweep_cost(const sweep_point *pt) {
+	return pt->config.E;
+}
+
+/* qsort order of point indexes, most expensive first */
+static const sweep_point *sweep_sorting;
+static int costlier_point(const void *a, const void *b) {
+	int ca = sweep_cost(&sweep_sorting[*(const int*)a]);
+	int cb = sweep_cost(&sweep_sorting[*(const int*)b]);
+	return (ca < cb) - (ca > cb);
+}
+
+/* 
+ * Run every point of the pool on n_workers threads. Points are dealt
+ * out by cost so each worker starts with a similar share and runs its
+ * expensive points first, a worker that runs dry steals the cheapest
+ * point left in another's deque, so the tail is made of short runs.
+ */
+void run_sweep(sweep_pool *pool, int n_workers) {
+	int *order = (int*)malloc(sizeof(int) * pool->n_points);
+	for(int i = 0; i < pool->n_points; i++) {
+		order[i] = i;
+	}
+	sweep_sorting = pool->points;
+	qsort(order, pool->n_points, sizeof(int), costlier_point);
+	pool->n_workers = n_workers;
+	pool->deques = (sweep_deque*)calloc(n_workers, sizeof(sweep_deque));
+	for(int i = 0; i < n_workers; i++) {
+		pool->deques[i].items = (int*)malloc(sizeof(int) * (pool->n_points / n_workers + 1));
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+	}
+	for(int i = 0; i < pool->n_points; i++) {
+		sweep_deque *dq = &pool->deques[i % n_workers];
+		dq->items[dq->bottom++] = order[i];
+	}
+	sweep_worker *workers = (sweep_worker*)calloc(n_workers, sizeof(sweep_worker));
+	for(int i = 0; i < n_workers; i++) {
+		workers[i].pool = pool;
+		workers[i].id = i;
+		pthread_create(&workers[i].thread, NULL, sweep_main, &workers[i]);
+	}
+	for(int i = 0; i < n_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	for(int i = 0; i < n_workers; i++) {
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].items);
+	}
+	free(pool->deques);
+	free(workers);
+	free(order);
+}
+
+/* Print one row per point, in grid order */
+void print_sweep(sweep_pool *pool) {
+	printf("%3s %5s %3s %-7s %12s %12s %12s %9s\n", 
+			"s", "E", "b", "policy", "hits", "misses", "evictions", "miss-rate");
+	for(int i = 0; i < pool->n_points; i++) {
+		sweep_point *pt = &pool->points[i];
+		csim_config *cf = &pt->config;
+		printf("%3d %5d %3d %-7s ", cf->s, cf->E, cf->b, cf->policy != NULL ? cf->policy : "lru");
+		if(!pt->ok) {
+			printf("invalid\n");
+			continue;
+		}
+		long accesses = pt->counts.hits + pt->counts.misses;
+		printf("%12ld %12ld %12ld %9.6f\n", pt->counts.hits, pt->counts.misses, 
+				pt->counts.evictions, accesses ? (double)pt->counts.misses / accesses : 0.0);
+	}
+}
+
+/* Generator state of a synthetic trace, xorshift so runs repeat */
+static unsigned long long int gen_random(unsigned long long int *x) {
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return *x;
+}
+
+/* Largest power of two at most n, at least 1 */
+static unsigned long long int pow2_floor(unsigned long long int n) {
+	unsigned long long int p = 1;
+	while(p <= n / 2) {
+		p *= 2;
+	}
+	return p;
+}
+
+/* 
+ * Generate the loads of a synthetic pattern, 8 bytes each from GEN_BASE.
+ * spec is one of
+ *   stream:n              n consecutive elements
+ *   stride:n:bytes        n elements bytes apart
+ *   random:n:footprint    n uniform elements of a footprint in bytes
+ *   zipf:n:footprint[:a]  n elements, the k-th most popular with odds 1/k^a
+ *   chase:n:footprint     n hops of a random cycle over 64 byte nodes
+ *   row:M:N, col:M:N      an M by N row major matrix, by rows or by columns
+ * Footprints are rounded down to a power of two elements. Return the
+ * records and their number in *n, or NULL for a bad spec.
+ */
+csim_record *generate_trace(const char *spec, size_t *n) {
+	char name[16];
+	unsigned long long int a = 0, b = 0;
+	double alpha = 0.99;
+	int fields = sscanf(spec, "%15[a-z]:%llu:%llu:%lf", name, &a, &b, &alpha);
+	if(fields < 2 || a == 0) {
+		return NULL;
+	}
+	int matrix = strcmp(name, "row") == 0 || strcmp(name, "col") == 0;
+	int sized = matrix || strcmp(name, "stride") == 0 || strcmp(name, "random") == 0 
+			|| strcmp(name, "zipf") == 0 || strcmp(name, "chase") == 0;
+	if(sized && (fields < 3 || b == 0)) {
+		return NULL;
+	}
+	*n = matrix ? a * b : a;
+	csim_record *records = (csim_record*)malloc(sizeof(csim_record) * *n);
+	unsigned long long int x = 0x9e3779b97f4a7c15ULL;
+	unsigned long long int elements = pow2_floor(b / GEN_ELEMENT);
+	if(strcmp(name, "chase") == 0) {
+		// Sattolo's shuffle gives a single cycle through every node
+		unsigned long long int nodes = pow2_floor(b / GEN_NODE);
+		unsigned long long int *next = (unsigned long long int*)malloc(sizeof(unsigned long long int) * nodes);
+		for(unsigned long long int i = 0; i < nodes; i++) {
+			next[i] = i;
+		}
+		for(unsigned long long int i = nodes - 1; i > 0; i--) {
+			unsigned long long int j = gen_random(&x) % i;
+			unsigned long long int t = next[i];
+			next[i] = next[j];
+			next[j] = t;
+		}
+		unsigned long long int node = 0;
+		for(size_t i = 0; i < *n; i++) {
+			records[i].addr = GEN_BASE + node * GEN_NODE;
+			node = next[node];
+		}
+		free(next);
+	}else {
+		for(size_t i = 0; i < *n; i++) {
+			unsigned long long int e;
+			if(strcmp(name, "stream") == 0) {
+				e = i;
+			}else if(strcmp(name, "stride") == 0) {
+				records[i].addr = GEN_BASE + i * b;
+				continue;
+			}else if(strcmp(name, "random") == 0) {
+				e = gen_random(&x) & (elements - 1);
+			}else if(strcmp(name, "zipf") == 0) {
+				// inverse of the continuous power law, then ranks scattered by an odd multiplier
+				double u = (gen_random(&x) >> 11) * (1.0 / 9007199254740992.0);
+				double rank = alpha == 1.0 ? pow((double)elements, u) 
+						: pow((pow((double)elements, 1 - alpha) - 1) * u + 1, 1 / (1 - alpha));
+				e = ((unsigned long long int)rank - 1) * 0x9e3779b97f4a7c15ULL & (elements - 1);
+			}else if(strcmp(name, "row") == 0) {
+				e = i;
+			}else if(strcmp(name, "col") == 0) {
+				e = (i % a) * b + i / a;
+			}else {
+				free(records);
+				return NULL;
+			}
+			records[i].addr = GEN_BASE + e * GEN_ELEMENT;
+		}
+	}
+	for(size_t i = 0; i < *n; i++) {
+		records[i].size = GEN_ELEMENT;
+		records[i].op = 'L';
+	}
+	return records;
+}
+
+/* 
+ * Time every point of the pool on this thread, one at a time so they do
+ * not share the host caches, and keep the fastest of BENCH_REPEAT runs
+ */
+void run_bench(sweep_pool *pool) {
+	for(int i = 0; i < pool->n_points; i++) {
+		sweep_point *pt = &pool->points[i];
+		for(int r = 0; r < BENCH_REPEAT; r++) {
+			csim *sim = csim_create(&pt->config);
+			if(sim == NULL) {
+				break;
+			}
+			double start = wall_seconds();
+			for(size_t j = 0; j < pool->n_records; j++) {
+				csim_visit(sim, pool->records[j].addr, pool->records[j].size, pool->records[j].op);
+			}
+			double seconds = wall_seconds() - start;
+			if(!pt->ok || seconds < pt->seconds) {
+				pt->seconds = seconds;
+			}
+			csim_stats(sim, &pt->counts);
+			pt->ok = 1;
+			csim_destroy(sim);
+		}
+	}
+}
+
+/* Print one row per point with its access rate, records named by name */
+void print_bench(sweep_pool *pool, const char *name, int header) {
+	if(header) {
+		printf("%-24s %3s %5s %3s %-7s %10s %9s %10s %9s\n", 
+				"trace", "s", "E", "b", "policy", "accesses", "seconds", "Macc/s", "miss-rate");
+	}
+	for(int i = 0; i < pool->n_points; i++) {
+		sweep_point *pt = &pool->points[i];
+		csim_config *cf = &pt->config;
+		printf("%-24s %3d %5d %3d %-7s ", name, cf->s, cf->E, cf->b, 
+				cf->policy != NULL ? cf->policy : "lru");
+		if(!pt->ok) {
+			printf("invalid\n");
+			continue;
+		}
+		long accesses = pt->counts.hits + pt->counts.misses;
+		printf("%10ld %9.4f %10.2f %9.6f\n", accesses, pt->seconds, 
+				pt->seconds > 0 ? accesses / pt->seconds / 1e6 : 0.0, 
+				accesses ? (double)pt->counts.misses / accesses : 0.0);
+	}
+}
+
+#ifndef CSIM_LIBRARY
+/* Patterns run by --bench without a trace, about a million accesses each */
+static const char *bench_suite[] = {
+	"stream:1048576", 
+	"stride:1048576:256", 
+	"random:1048576:33554432", 
+	"zipf:1048576:33554432", 
+	"chase:1048576:33554432", 
+	"row:1024:1024", 
+	"col:1024:1024"
+};
 
 int main(int argc, char **argv) {
 	int v = 0;
 	cache_parameter para;
-	para.hit_count = 0;
-	para.miss_count = 0;
-	para.eviction_count = 0;
+	para.s = para.E = para.b = 0;
+	para.policy = find_policy("lru");
+	para.write_back = 1;
+	para.write_allocate = 1;
+	reset_counts(&para);
 	// get opt from command line
 	char *trace_file = NULL;
-	char c;
-	while((c = getopt (argc, argv, "s:E:b:t:v")) != -1) {
+	char *convert_file = NULL;  // write binary trace here and exit
+	cache_level levels[MAX_LEVELS];  // L1 from -s/-E/-b/-p, lower levels from -L
+	int n_levels = 1;
+	int inclusion = INCL_NINE;
+	int threads = 1;  // simulation threads, sets are split between them
+	int stack_mode = 0;  // print LRU miss ratio curves instead of simulating
+	char *profile_file = NULL;  // write reuse and per set profile here
+	int classify = 0;  // split misses into compulsory, capacity and conflict
+	int write_model = 0;  // report write-backs and traffic, set by -W or -A
+	int split_blocks = 0;  // visit every block an access touches, not just the first
+	unsigned long long int interval_records = 0;  // report deltas every this many records
+	double interval_seconds = 0;  // or every this many seconds
+	char *core_traces[MAX_CORES];  // every -t, one per core of a coherent run
+	int n_cores = 0;
+	int protocol = -1;  // -1 without coherence, else 1 for MOESI and 0 for MESI
+	int order = ORDER_ROUND_ROBIN;  // merge order of the per core traces
+	char *prefetch_spec = NULL;  // prefetch engine of the cache
+	char *sweep_grid = NULL;  // run every configuration of this grid instead
+	int collapse_runs = 0;  // visit runs of records to one block as counted hits
+	int sample_ratio = 1;  // simulate about one set in this many
+	unsigned long long int fast_forward = 0;  // records skipped unsimulated
+	unsigned long long int warmup = 0;  // records simulated before counting starts
+	char *checkpoint_file = NULL;  // save the run here every checkpoint_every records
+	unsigned long long int checkpoint_every = CHECKPOINT_EVERY;
+	char *resume_file = NULL;  // continue the run saved here
+	char *timing_spec = NULL;  // latencies of the -M timing model
+	char *index_name = "low";  // set index function of every level
+	tlb_model tlb;  // levels from -K, pages from -g, off without -K
+	init_tlb(&tlb);
+	char *page_map = NULL;
+	char *generate_spec = NULL;  // synthetic pattern used instead of -t
+	char *bench_grid = NULL;  // time every configuration of this grid instead
+	// long only options, numbered past every short one
+	enum {OPT_CHECKPOINT = 256, OPT_CHECKPOINT_EVERY, OPT_RESUME, OPT_GENERATE, OPT_BENCH};
+	static const struct option long_options[] = {
+		{"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+		{"checkpoint-every", required_argument, NULL, OPT_CHECKPOINT_EVERY},
+		{"resume", required_argument, NULL, OPT_RESUME},
+		{"generate", required_argument, NULL, OPT_GENERATE},
+		{"bench", required_argument, NULL, OPT_BENCH},
+		{NULL, 0, NULL, 0}
+	};
+	int c;
+	while((c = getopt_long(argc, argv, "s:E:b:t:c:p:L:I:j:P:W:A:i:T:C:o:F:S:f:w:G:M:H:K:g:3dxrv", 
+			long_options, NULL)) != -1) {
 		switch(c) {
 			case 'v':
 				v = 1;
 				break;
 			case 's':
 				para.s = atoi(optarg);
+				break;
 			case 'E':
 				para.E = atoi(optarg);
+				break;
 			case 'b':
 				para.b = atoi(optarg);
+				break;
 			case 't':
 				trace_file = optarg;
+				if(n_cores < MAX_CORES) {
+					core_traces[n_cores++] = optarg;
+				}
+				break;
+			case 'C':
+				if(strcmp(optarg, "mesi") == 0) {
+					protocol = 0;
+				}else if(strcmp(optarg, "moesi") == 0) {
+					protocol = 1;
+				}else {
+					printf("unknown coherence protocol %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'o':
+				if(strcmp(optarg, "ts") == 0) {
+					order = ORDER_TIMESTAMP;
+				}else if(strcmp(optarg, "rr") == 0) {
+					order = ORDER_ROUND_ROBIN;
+				}else {
+					printf("unknown trace order %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'c':
+				convert_file = optarg;
+				break;
+			case 'p':
+				para.policy = find_policy(optarg);
+				if(para.policy == NULL) {
+					printf("unknown replacement policy %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'L':
+				if(n_levels == MAX_LEVELS || parse_level(optarg, &levels[n_levels].para) != 0) {
+					printf("err level %s\n", optarg);
+					return 1;
+				}
+				n_levels++;
+				break;
+			case 'd':
+				stack_mode = 1;
+				break;
+			case 'x':
+				split_blocks = 1;
+				break;
+			case 'r':
+				collapse_runs = 1;
+				break;
+			case 'M':
+				timing_spec = optarg;
+				break;
+			case 'H':
+				index_name = optarg;
+				break;
+			case 'K':
+				if(add_tlb_level(&tlb, optarg) != 0) {
+					printf("err TLB level %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'g':
+				page_map = optarg;
+				if(set_page_map(&tlb, optarg) != 0) {
+					printf("err page map %s\n", optarg);
+					return 1;
+				}
+				break;
+			case OPT_CHECKPOINT:
+				checkpoint_file = optarg;
+				break;
+			case OPT_CHECKPOINT_EVERY:
+				checkpoint_every = strtoull(optarg, NULL, 10);
+				if(checkpoint_every == 0) {
+					checkpoint_every = CHECKPOINT_EVERY;
+				}
+				break;
+			case OPT_RESUME:
+				resume_file = optarg;
+				break;
+			case OPT_GENERATE:
+				generate_spec = optarg;
+				break;
+			case OPT_BENCH:
+				bench_grid = optarg;
+				break;
+			case 'i':
+				interval_records = strtoull(optarg, NULL, 10);
+				break;
+			case 'T':
+				interval_seconds = atof(optarg);
+				break;
+			case 'P':
+				profile_file = optarg;
+				break;
+			case 'F':
+				prefetch_spec = optarg;
+				break;
+			case 'G':
+				sweep_grid = optarg;
+				break;
+			case 'S':
+				sample_ratio = atoi(optarg);
+				break;
+			case 'f':
+				fast_forward = strtoull(optarg, NULL, 10);
+				break;
+			case 'w':
+				warmup = strtoull(optarg, NULL, 10);
+				break;
+			case '3':
+				classify = 1;
+				break;
+			case 'W':
+				write_model = 1;
+				para.write_back = strcmp(optarg, "wt") != 0;
+				break;
+			case 'A':
+				write_model = 1;
+				para.write_allocate = strcmp(optarg, "nwa") != 0;
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'I':
+				if(strcmp(optarg, "inclusive") == 0) {
+					inclusion = INCL_INCLUSIVE;
+				}else if(strcmp(optarg, "exclusive") == 0) {
+					inclusion = INCL_EXCLUSIVE;
+				}else if(strcmp(optarg, "nine") == 0) {
+					inclusion = INCL_NINE;
+				}else {
+					printf("unknown inclusion policy %s\n", optarg);
+					return 1;
+				}
+				break;
 			default:
 				break;
 		}
 	}	
+	init_digit_table();
+	int span_bits = split_blocks ? para.b : 64;  // see next_piece
+	if(convert_file != NULL) {
+		trace_reader reader;
+		long n = -1;
+		if(trace_file != NULL && open_trace(&reader, trace_file) == 0) {
+			n = convert_trace(&reader, convert_file);
+			close_trace(&reader);
+		}
+		if(n < 0) {
+			printf("trace file cannot be converted.\n");
+			return 1;
+		}
+		printf("converted %ld records\n", n);
+		return 0;
+	}
+	if(stack_mode) {
+		// one pass gives every LRU size, E and the policy do not matter
+		trace_reader reader;
+		trace_record rec, piece;
+		sd_engine sd;
+		if(trace_file == NULL || open_trace(&reader, trace_file) != 0) {
+			printf("trace file cannot be opened.\n");
+			return 1;
+		}
+		init_stack_distance(&sd, para.s, para.b, 0);
+		while(next_record(&reader, &rec)) {
+			while(next_piece(&rec, span_bits, &piece)) {
+				if(piece.op == 'L' || piece.op == 'S') {
+					stack_distance_access(&sd, piece.addr);
+				}else if(piece.op == 'M') {
+					stack_distance_access(&sd, piece.addr);
+					stack_distance_access(&sd, piece.addr);
+				}
+			}
+		}
+		close_trace(&reader);
+		print_stack_distance(&sd);
+		free_stack_distance(&sd);
+		return 0;
+	}
+	if(generate_spec != NULL && sweep_grid == NULL && bench_grid == NULL) {
+		// print the pattern as a text trace, for -t - or -c
+		size_t n;
+		csim_record *records = generate_trace(generate_spec, &n);
+		if(records == NULL) {
+			printf("err pattern %s\n", generate_spec);
+			return 1;
+		}
+		for(size_t i = 0; i < n; i++) {
+			printf(" %c %llx,%d\n", records[i].op, records[i].addr, records[i].size);
+		}
+		free(records);
+		return 0;
+	}
+	if(sweep_grid != NULL || bench_grid != NULL) {
+		// one decode, then every point runs from memory; -j sets the sweep's workers
+		csim_config base = {para.s, para.E, para.b, para.policy->name, !para.write_back, 
+				!para.write_allocate, prefetch_spec, split_blocks, index_name};
+		const char *grid = sweep_grid != NULL ? sweep_grid : bench_grid;
+		int suite = bench_grid != NULL && generate_spec == NULL && trace_file == NULL;
+		int n_traces = suite ? (int)(sizeof(bench_suite) / sizeof(bench_suite[0])) : 1;
+		for(int t = 0; t < n_traces; t++) {
+			sweep_pool pool;
+			csim_record *records;
+			const char *name = suite ? bench_suite[t] : generate_spec != NULL ? generate_spec : trace_file;
+			pool.n_points = parse_sweep(grid, base, &pool.points);
+			if(pool.n_points < 0) {
+				printf("err grid %s\n", grid);
+				return 1;
+			}
+			if(suite || generate_spec != NULL) {
+				records = generate_trace(name, &pool.n_records);
+				if(records == NULL) {
+					printf("err pattern %s\n", name);
+					return 1;
+				}
+			}else {
+				trace_reader reader;
+				if(trace_file == NULL || open_trace(&reader, trace_file) != 0) {
+					printf("trace file cannot be opened.\n");
+					return 1;
+				}
+				records = decode_trace(&reader, &pool.n_records);
+				close_trace(&reader);
+			}
+			pool.records = records;
+			if(bench_grid != NULL) {
+				run_bench(&pool);
+				print_bench(&pool, name, t == 0);
+			}else {
+				int workers = threads > 1 ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+				if(workers > pool.n_points) {
+					workers = pool.n_points;
+				}
+				run_sweep(&pool, workers < 1 ? 1 : workers);
+				print_sweep(&pool);
+			}
+			free(records);
+			free(pool.points);
+		}
+		return 0;
+	}
 	if(para.s == 0 || para.E == 0 || para.b == 0 || trace_file == NULL)	{
 		printf("err input\n");
 	}
+	if(set_index(index_name, &para) != 0) {
+		printf("unknown index function %s\n", index_name);
+		return 1;
+	}
+	levels[0].para = para;
+	for(int i = 0; i < n_levels; i++) {
+		set_index(index_name, &levels[i].para);
+		char why[64];
+		if(check_policy(levels[i].para, why, sizeof(why)) != 0) {
+			printf("%s\n", why);
+			return 1;
+		}
+	}
+	for(int i = 1; i < n_levels; i++) {
+		// an upper block must fit in the lower one it is back-invalidated with,
+		// and an exclusive victim must fit the line it drops into
+		if((inclusion == INCL_INCLUSIVE && levels[i].para.b < levels[i - 1].para.b) 
+				|| (inclusion == INCL_EXCLUSIVE && levels[i].para.b != levels[i - 1].para.b)) {
+			printf("-I %s needs %s block size at every lower level\n", 
+					inclusion == INCL_INCLUSIVE ? "inclusive" : "exclusive", 
+					inclusion == INCL_INCLUSIVE ? "the same or a larger" : "the same");
+			return 1;
+		}
+	}
+	if(para.index == INDEX_SKEW && (n_levels > 1 || threads > 1 || protocol >= 0 || profile_file != NULL 
+			|| classify || prefetch_spec != NULL || sample_ratio > 1 || collapse_runs)) {
+		// a block has no single set to share, profile, sample or prefetch into
+		printf("-H skew needs a plain single level, single thread run\n");
+		return 1;
+	}
+	if((profile_file != NULL || classify) && (n_levels > 1 || threads > 1)) {
+		printf("-P and -3 need a single level, single thread run\n");
+		return 1;
+	}
+	int intervals = interval_records != 0 || interval_seconds > 0;
+	if(write_model && n_levels > 1) {
+		// the hierarchy keeps no dirty lines, stores there are loads
+		printf("-W and -A need a single level run\n");
+		return 1;
+	}
+	if(prefetch_spec != NULL && (n_levels > 1 || threads > 1 || protocol >= 0)) {
+		// prefetches cross sets and the hierarchy fills levels itself
+		printf("-F needs a single level, single thread run without -C\n");
+		return 1;
+	}
+	if(sample_ratio > 1 && (n_levels > 1 || threads > 1 || protocol >= 0 || profile_file != NULL 
+			|| classify || prefetch_spec != NULL || intervals)) {
+		printf("-S needs a single level, single thread run without -C, -P, -3, -F, -i or -T\n");
+		return 1;
+	}
+	if(collapse_runs && (n_levels > 1 || threads > 1 || protocol >= 0 || profile_file != NULL 
+			|| classify || prefetch_spec != NULL || sample_ratio > 1 || intervals || v == 1)) {
+		// those look at every access, or print it
+		printf("-r needs a plain single level, single thread run\n");
+		return 1;
+	}
+	if((checkpoint_file != NULL || resume_file != NULL) && (threads > 1 || protocol >= 0 
+			|| profile_file != NULL || classify || prefetch_spec != NULL || sample_ratio > 1 
+			|| timing_spec != NULL)) {
+		// only the caches, counts and trace position are saved
+		printf("--checkpoint and --resume need a single thread run without -C, -P, -3, -F, -S or -M\n");
+		return 1;
+	}
+	if(page_map != NULL && tlb.n_levels == 0) {
+		printf("-g needs a TLB from -K\n");
+		return 1;
+	}
+	if(tlb.n_levels != 0 && (threads > 1 || protocol >= 0 || profile_file != NULL || classify 
+			|| sample_ratio > 1 || collapse_runs || checkpoint_file != NULL || resume_file != NULL)) {
+		// translations follow trace order, and the TLB is not saved
+		printf("-K needs a single thread run without -C, -P, -3, -S, -r or checkpoints\n");
+		return 1;
+	}
+	timing_model tm;
+	if(timing_spec != NULL) {
+		if(threads > 1 || protocol >= 0 || sample_ratio > 1 || collapse_runs) {
+			// each access must be seen in trace order
+			printf("-M needs a single thread run without -C, -S or -r\n");
+			return 1;
+		}
+		if(init_timing(&tm, timing_spec, para.b) != 0 || tm.n_levels != n_levels) {
+			printf("err timing %s, give one hit latency per level\n", timing_spec);
+			return 1;
+		}
+	}
+	if((fast_forward != 0 || warmup != 0) && (threads > 1 || protocol >= 0 
+			|| profile_file != NULL || classify)) {
+		printf("-f and -w need a single thread run without -C, -P or -3\n");
+		return 1;
+	}
+	if(protocol >= 0) {
+		// each -t is one core, private caches are write-back write-allocate
+		if(n_levels > 1 || threads > 1 || profile_file != NULL || classify 
+				|| intervals || write_model) {
+			printf("-C needs a single level, single thread run without -P, -3, -i, -T, -W or -A\n");
+			return 1;
+		}
+		coherence_sim sim;
+		if(n_cores == 0 || init_coherence(&sim, para, core_traces, n_cores, protocol) != 0) {
+			if(n_cores == 0) {
+				printf("err input\n");
+			}else {
+				free_coherence(&sim);
+			}
+			return 1;
+		}
+		simulate_coherent(&sim, order, span_bits, v);
+		print_coherence(&sim);
+		long hits = 0, misses = 0, evictions = 0;
+		for(int i = 0; i < sim.n; i++) {
+			hits += sim.cores[i].para.hit_count;
+			misses += sim.cores[i].para.miss_count;
+			evictions += sim.cores[i].para.eviction_count;
+		}
+		free_coherence(&sim);
+		printSummary(hits, misses, evictions);
+		return 0;
+	}
+	if(threads > 1 && (n_levels > 1 || v == 1 || intervals 
+			|| strcmp(para.policy->name, "drrip") == 0)) {
+		// levels index sets differently and DRRIP duels across sets
+		printf("-j needs a single level, non-verbose, non-drrip run without intervals\n");
+		return 1;
+	}
+	if(threads > (1 << para.s)) {
+		threads = 1 << para.s;
+	}
 	// initialize cache
-	cache new_cache = init_cache(para);
+	for(int i = 0; i < n_levels; i++) {
+		levels[i].c = init_cache(levels[i].para);
+		levels[i].back_invalidations = 0;
+	}
+	cache new_cache = levels[0].c;
+	alloc_tlb(&tlb);
+	prefetcher pf;
+	if(prefetch_spec != NULL) {
+		if(init_prefetcher(&pf, prefetch_spec, para) != 0) {
+			printf("err prefetcher %s\n", prefetch_spec);
+			return 1;
+		}
+		new_cache.pf = &pf;
+	}
+	set_sample sample;
+	if(sample_ratio > 1) {
+		init_sampling(&sample, para, sample_ratio);
+	}
+	cache_profile prof;
+	miss_classifier classes;
+	sim_instruments ins = {NULL, NULL};
+	if(profile_file != NULL) {
+		init_profile(&prof, para.s, para.b);
+		ins.prof = &prof;
+	}
+	if(classify) {
+		init_classifier(&classes, para);
+		ins.classes = &classes;
+	}
 	// get memory trace
-	int size;
-	unsigned long long addr;
-	char opt;	
-	FILE *file = fopen(trace_file, "r");
-	if(file != NULL) {
-		int cnt = 1;  // record access time
-		while(fscanf(file, " %c %llx, %d", &opt, &addr, &size) == 3) {
+	trace_reader reader;
+	trace_record rec, piece;
+	interval_stats is;
+	init_intervals(&is, interval_records, interval_seconds);
+	if(threads > 1 && open_trace(&reader, trace_file) == 0) {
+		para = simulate_sharded(para, &new_cache, &reader, threads, span_bits);
+		close_trace(&reader);
+	}else if(open_trace(&reader, trace_file) == 0) {
+		unsigned long long int cnt = 1;  // record access time
+		if((checkpoint_file != NULL || resume_file != NULL) && reader.map == NULL) {
+			printf("--checkpoint and --resume need a trace file, not a stream\n");
+			return 1;
+		}
+		if(resume_file != NULL) {
+			// a single level run keeps its cache and counts in new_cache and para
+			if(n_levels == 1) {
+				levels[0].para = para;
+				levels[0].c = new_cache;
+			}
+			if(load_checkpoint(resume_file, levels, n_levels, inclusion, &reader, &cnt) != 0) {
+				return 1;
+			}
+			if(n_levels == 1) {
+				para = levels[0].para;
+				new_cache = levels[0].c;
+			}
+			fast_forward = 0;  // the checkpoint is past it already
+		}
+		for(unsigned long long int i = 0; i < fast_forward && next_record(&reader, &rec); i++) {
+		}
+		access_run run = {0, 0, 0, 0, 0};
+		while(next_record(&reader, &rec)) {
+			if(warmup != 0 && cnt == warmup + 1) {
+				// the caches stay warm, only the counts start over
+				if(run.n != 0) {
+					para = visit_run(para, &new_cache, &run);
+					run.n = 0;
+				}
+				reset_counts(&para);
+				for(int i = 0; i < n_levels; i++) {
+					reset_counts(&levels[i].para);
+					levels[i].back_invalidations = 0;
+				}
+				if(sample_ratio > 1) {
+					reset_sampling(&sample);
+				}
+				if(prefetch_spec != NULL) {
+					pf.issued = pf.useful = pf.late = pf.polluting = pf.useless = pf.evictions = 0;
+				}
+				if(timing_spec != NULL) {
+					reset_timing(&tm);
+				}
+				reset_tlb(&tlb);
+				init_intervals(&is, interval_records, interval_seconds);
+				is.records = warmup;
+			}
 			if(v == 1) {
-				printf("%c %llx,%d ", opt, addr, size);
+				printf("%c %llx,%d ", rec.op, rec.addr, rec.size);
+			}
+			// with -x an access straddling blocks visits each of them
+			while(next_piece(&rec, span_bits, &piece)) {
+				unsigned long long int translation = 0;  // cycles to translate the address, for -M
+				if(tlb.n_levels != 0 && (piece.op == 'L' || piece.op == 'S' || piece.op == 'M')) {
+					translation = translate(&tlb, piece.addr, cnt, &para, &new_cache, levels, n_levels, 
+							inclusion, timing_spec != NULL ? &tm : NULL, v);
+				}
+				int served = 0;  // level the first access found the block at, for -M
+				long misses = para.miss_count;
+				if(n_levels > 1) {
+					if(piece.op == 'L' || piece.op == 'S') {
+						served = visit_hierarchy(levels, n_levels, inclusion, piece.addr, cnt, v);
+					}else if(piece.op == 'M') {
+						served = visit_hierarchy(levels, n_levels, inclusion, piece.addr, cnt, v);
+						visit_hierarchy(levels, n_levels, inclusion, piece.addr, cnt, v);
+					}
+				}else if(collapse_runs) {
+					if(run.n != 0 && piece.op == run.op && piece.size == run.size 
+							&& (piece.addr ^ run.addr) >> para.b == 0) {
+						run.n++;
+						continue;
+					}
+					if(run.n != 0) {
+						para = visit_run(para, &new_cache, &run);
+						run.n = 0;
+					}
+					if(piece.op == 'L' || piece.op == 'S' || piece.op == 'M') {
+						run.op = piece.op;
+						run.size = piece.size;
+						run.addr = piece.addr;
+						run.cnt = cnt;
+						run.n = 1;
+					}
+				}else if(sample_ratio > 1) {
+					para = visit_sampled(para, &new_cache, &sample, piece.op, piece.addr, piece.size, cnt, v);
+				}else if(ins.prof != NULL || ins.classes != NULL) {
+					if(piece.op == 'L' || piece.op == 'M') {
+						para = visit_instrumented(para, &new_cache, &ins, piece.addr, piece.size, cnt, 0, v);
+					}
+					if(piece.op == 'S' || piece.op == 'M') {
+						para = visit_instrumented(para, &new_cache, &ins, piece.addr, piece.size, cnt, 1, v);
+					}
+				}else {
+					para = visit_op(para, &new_cache, piece.op, piece.addr, piece.size, cnt, v);
+				}
+				if(timing_spec != NULL && (piece.op == 'L' || piece.op == 'S' || piece.op == 'M')) {
+					// a single level served from memory iff the first access missed
+					if(n_levels == 1) {
+						served = para.miss_count > misses;
+					}
+					time_access(&tm, piece.addr, served, piece.op == 'S', translation);
+				}
 			}
-			if(opt == 'L') {
-				para = visit_cache(para, &new_cache, addr, cnt, v);
-			}else if(opt == 'S') {
-				para = visit_cache(para, &new_cache, addr, cnt, v);
-			}else if(opt == 'M') {
-				para = visit_cache(para, &new_cache, addr, cnt, v);
-				para = visit_cache(para, &new_cache, addr, cnt, v);
+			if(intervals) {
+				report_interval(&is, cnt, levels, n_levels, para, 0);
 			}
 			cnt++;
+			if(checkpoint_file != NULL && (cnt - 1) % checkpoint_every == 0) {
+				if(run.n != 0) {
+					para = visit_run(para, &new_cache, &run);
+					run.n = 0;
+				}
+				if(n_levels == 1) {
+					levels[0].para = para;
+					levels[0].c = new_cache;
+				}
+				if(write_checkpoint(checkpoint_file, levels, n_levels, inclusion, &reader, cnt) != 0) {
+					printf("checkpoint %s cannot be written.\n", checkpoint_file);
+				}
+			}
+		}
+		if(run.n != 0) {
+			para = visit_run(para, &new_cache, &run);
 		}
+		if(intervals) {
+			report_interval(&is, cnt - 1, levels, n_levels, para, 1);
+		}
+		close_trace(&reader);
 	}else {
 		printf("trace file cannot be opened.\n");
 	}
-	fclose(file);
-	file = NULL;
-	free(file);
 	trace_file = NULL;
 	free(trace_file);
+	if(n_levels > 1) {
+		// per level counts, then hits at any level, memory accesses, all evictions
+		long hits = 0, evictions = 0;
+		for(int i = 0; i < n_levels; i++) {
+			cache_parameter *lp = &levels[i].para;
+			printf("L%d hits:%ld misses:%ld evictions:%ld back-invalidations:%ld\n", i + 1, 
+					lp->hit_count, lp->miss_count, lp->eviction_count, levels[i].back_invalidations);
+			hits += lp->hit_count;
+			evictions += lp->eviction_count;
+			free_cache(levels[i].c, *lp);
+		}
+		if(tlb.n_levels != 0) {
+			print_tlb(&tlb, timing_spec != NULL);
+			free_tlb(&tlb);
+		}
+		if(timing_spec != NULL) {
+			print_timing(&tm);
+			free_timing(&tm);
+		}
+		printSummary(hits, levels[n_levels - 1].para.miss_count, evictions);
+		return 0;
+	}
+	if(sample_ratio > 1) {
+		// the summary and the write model line hold the extrapolated totals
+		print_sampling(&sample, &para);
+		free_sampling(&sample);
+	}
+	if(profile_file != NULL) {
+		if(write_profile(&prof, para, profile_file) != 0) {
+			printf("profile cannot be written.\n");
+		}
+		free_profile(&prof);
+	}
+	if(write_model) {
+		printf("dirty-evictions:%ld bytes-read:%llu bytes-written:%llu\n", 
+				para.dirty_eviction_count, para.bytes_read, para.bytes_written);
+	}
+	if(classify) {
+		printf("compulsory:%ld capacity:%ld conflict:%ld\n", 
+				classes.compulsory, classes.capacity_misses, classes.conflict);
+		free_classifier(&classes);
+	}
+	if(prefetch_spec != NULL) {
+		// demand counts below exclude the prefetches and their evictions
+		printf("prefetch issued:%ld useful:%ld late:%ld polluting:%ld useless:%ld evictions:%ld\n", 
+				pf.issued, pf.useful, pf.late, pf.polluting, pf.useless, pf.evictions);
+		free_prefetcher(&pf);
+	}
+	if(tlb.n_levels != 0) {
+		print_tlb(&tlb, timing_spec != NULL);
+		free_tlb(&tlb);
+	}
+	if(timing_spec != NULL) {
+		print_timing(&tm);
+		free_timing(&tm);
+	}
 	free_cache(new_cache, para);
 	printSummary(para.hit_count, para.miss_count, para.eviction_count);	
 	return 0;
 }
-
+#endif
@@ -0,0 +1,74 @@
+/*
+ *
+ * Library interface of the CachePlay.c cache simulator
+ * Build CachePlay.c with -DCSIM_LIBRARY to leave out main
+ * Every handle owns all of its state, handles can be used from
+ * different threads at once, one handle from one thread at a time
+ *
+*/
+
+#ifndef CACHEPLAY_H
+#define CACHEPLAY_H
+
+#include <stddef.h>
+
+/* Configuration of a simulated cache */
+typedef struct {
+	int s;  // S = 2^s set index bits
+	int E;  // associativity, E lines per set
+	int b;  // B = 2^b block bits
+	const char *policy;  // replacement policy name, NULL for lru
+	int write_through;  // 0 write-back, 1 write-through
+	int no_write_allocate;  // 0 write-allocate, 1 no-write-allocate
+	const char *prefetch;  // "engine[:degree[:distance[:latency]]]", NULL for none
+	int split_blocks;  // 1 to visit every block an access touches, not just the first
+	const char *index;  // set index function, low, xor, prime or skew (not with prefetch), NULL for low
+} csim_config;
+
+/* One access of a batch */
+typedef struct {
+	unsigned long long int addr;
+	int size;  // access size in bytes
+	char op;  // L load, S store, M load then store, anything else is skipped
+} csim_record;
+
+/* Counts of a handle since it was created */
+typedef struct {
+	long hits;
+	long misses;
+	long evictions;
+	long dirty_evictions;  // evictions that wrote the line back
+	unsigned long long int bytes_read;  // bytes filled from the next level
+	unsigned long long int bytes_written;  // bytes written to the next level
+	long prefetches;  // prefetches issued, not part of the counts above
+	long useful_prefetches;  // prefetched lines later demanded
+} csim_counts;
+
+/* Result of csim_access */
+enum {
+	CSIM_HIT,
+	CSIM_MISS,
+	CSIM_MISS_EVICTION
+};
+
+typedef struct csim csim;
+
+/* Create a cache, return NULL on a bad configuration */
+csim *csim_create(const csim_config *config);
+
+/*
+ * Run one access through the cache, return the CSIM_ result of its
+ * first block, the load for an M. Return -1 for an op it skips.
+ */
+int csim_access(csim *sim, unsigned long long int addr, int size, char op);
+
+/* Run n accesses through the cache in order */
+void csim_access_batch(csim *sim, const csim_record *records, size_t n);
+
+/* Copy the counts so far into *counts */
+void csim_stats(const csim *sim, csim_counts *counts);
+
+/* Free the cache */
+void csim_destroy(csim *sim);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ *
+ * Header only tracer feeding CachePlay.c while the traced program runs
+ * TRACE_LOAD(ptr, size) and TRACE_STORE(ptr, size) append 8 byte records
+ * to a single producer single consumer ring in POSIX shared memory, the
+ * simulator drains it at the same time with -t ring:/name
+ *
+ * In exactly one file of the traced program
+ *     #define CACHETRACE_IMPLEMENTATION
+ *     #include "cachetrace.h"
+ * then call cachetrace_start("/name", 0) before the loop and
+ * cachetrace_stop() after it, from the one thread that traces.
+ * Build with -DCACHETRACE_OFF to compile the macros out.
+ * A full ring makes the producer wait, so memory stays bounded and no
+ * record is lost.
+ *
+*/
+
+#ifndef CACHETRACE_H
+#define CACHETRACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define CACHETRACE_MAGIC 0x31474e4952544343ULL  // "CCTRING1", written once the ring is ready
+#define CACHETRACE_CAPACITY (1 << 20)  // default records of a ring, 8MB
+#define CACHETRACE_BATCH 64  // records between publishing head or tail
+#define CACHETRACE_LINE 64  // head and tail live on their own cache lines
+#define CACHETRACE_SIZE_MAX 16383  // larger sizes are clamped
+
+/* 
+ * Header of the shared ring, the records follow it. A record is
+ * addr << 16 | size << 2 | op, op 1 for a load and 2 for a store,
+ * so addresses keep their low 48 bits.
+ */
+typedef struct {
+	unsigned long long int magic;
+	unsigned long long int capacity;  // records, a power of two
+	unsigned int closed;  // 1 once either side is done with the ring
+	char pad0[CACHETRACE_LINE - 20];
+	unsigned long long int head;  // records published by the producer
+	char pad1[CACHETRACE_LINE - 8];
+	unsigned long long int tail;  // records consumed by the simulator
+	char pad2[CACHETRACE_LINE - 8];
+} cachetrace_ring;
+
+/* Producer side, private to the traced process */
+typedef struct {
+	cachetrace_ring *ring;  // NULL while not tracing
+	unsigned long long int *records;
+	unsigned long long int mask;  // capacity - 1
+	unsigned long long int head;  // records written, published every batch
+	unsigned long long int tail;  // last tail read, refreshed only when the ring looks full
+	size_t len;  // length of the mapping
+} cachetrace_producer;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CACHETRACE_IMPLEMENTATION
+cachetrace_producer cachetrace_self;
+#else
+extern cachetrace_producer cachetrace_self;
+#endif
+
+/* 
+ * Create the ring name, replacing any earlier one, with room for
+ * capacity records rounded up to a power of two, 0 for the default.
+ * Return 0 on success, -1 if it cannot be created.
+ */
+static inline int cachetrace_start(const char *name, unsigned long long int capacity) {
+	cachetrace_producer *p = &cachetrace_self;
+	unsigned long long int cap = 1;
+	while(cap < (capacity != 0 ? capacity : CACHETRACE_CAPACITY)) {
+		cap *= 2;
+	}
+	size_t len = sizeof(cachetrace_ring) + cap * sizeof(unsigned long long int);
+	shm_unlink(name);
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if(fd < 0) {
+		return -1;
+	}
+	if(ftruncate(fd, (off_t)len) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mem == MAP_FAILED) {
+		shm_unlink(name);
+		return -1;
+	}
+	memset(&cachetrace_self, 0, sizeof(cachetrace_self));
+	p->ring = (cachetrace_ring*)mem;
+	p->records = (unsigned long long int*)(p->ring + 1);
+	p->mask = cap - 1;
+	p->len = len;
+	p->ring->capacity = cap;
+	__atomic_store_n(&p->ring->magic, CACHETRACE_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* 
+ * Publish the records written so far, then wait until the consumer
+ * frees a slot. Return -1 if the consumer closed the ring instead.
+ */
+static inline int cachetrace_wait(cachetrace_producer *p) {
+	__atomic_store_n(&p->ring->head, p->head, __ATOMIC_RELEASE);
+	while((p->tail = __atomic_load_n(&p->ring->tail, __ATOMIC_ACQUIRE)) + p->mask + 1 == p->head) {
+		if(__atomic_load_n(&p->ring->closed, __ATOMIC_ACQUIRE)) {
+			return -1;
+		}
+		sched_yield();
+	}
+	return 0;
+}
+
+/* Append one record, op 1 for a load and 2 for a store */
+static inline void cachetrace_put(unsigned long long int addr, unsigned long long int size, int op) {
+	cachetrace_producer *p = &cachetrace_self;
+	if(p->ring == NULL) {
+		return;
+	}
+	if(p->head - p->tail > p->mask && cachetrace_wait(p) != 0) {
+		// the simulator stopped early, stop tracing
+		munmap(p->ring, p->len);
+		p->ring = NULL;
+		return;
+	}
+	if(size > CACHETRACE_SIZE_MAX) {
+		size = CACHETRACE_SIZE_MAX;
+	}
+	p->records[p->head & p->mask] = addr << 16 | size << 2 | (unsigned long long int)op;
+	p->head++;
+	if((p->head & (CACHETRACE_BATCH - 1)) == 0) {
+		__atomic_store_n(&p->ring->head, p->head, __ATOMIC_RELEASE);
+	}
+}
+
+/* Publish the last records and close the ring, the simulator ends once it drains it */
+static inline void cachetrace_stop(void) {
+	cachetrace_producer *p = &cachetrace_self;
+	if(p->ring == NULL) {
+		return;
+	}
+	__atomic_store_n(&p->ring->head, p->head, __ATOMIC_RELEASE);
+	__atomic_store_n(&p->ring->closed, 1, __ATOMIC_RELEASE);
+	munmap(p->ring, p->len);
+	p->ring = NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef CACHETRACE_OFF
+#define TRACE_LOAD(ptr, size) ((void)0)
+#define TRACE_STORE(ptr, size) ((void)0)
+#else
+#define TRACE_LOAD(ptr, size) cachetrace_put((unsigned long long int)(uintptr_t)(ptr), (size), 1)
+#define TRACE_STORE(ptr, size) cachetrace_put((unsigned long long int)(uintptr_t)(ptr), (size), 2)
+#endif
+
+#endif